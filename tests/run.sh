@@ -0,0 +1,48 @@
+#!/bin/sh
+# Regression checks for the compiler's built-in tools.
+# usage: tests/run.sh path/to/wlp4gen
+# Each .wlp4i here was produced from the .wlp4 next to it.
+
+gen=${1:?usage: tests/run.sh path/to/wlp4gen}
+dir=$(dirname "$0")
+fail=0
+
+check() {                       # name expected actual
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$2', got '$3'"
+        fail=1
+    fi
+}
+
+# new int[n] with n <= 0 fails like alloc.merl and yields NULL
+check "new int[0] is NULL" 1 "$("$gen" --run 0 5 < "$dir/new0.wlp4i" 2>/dev/null)"
+check "new int[-1] is NULL" 1 "$("$gen" --run -1 5 < "$dir/new0.wlp4i" 2>/dev/null)"
+check "new int[3] succeeds" 0 "$("$gen" --run 3 5 < "$dir/new0.wlp4i" 2>/dev/null)"
+
+# the heap is alloc.merl's: 64 blocks of new int[8], then NULL
+check "new int[8] runs out after 64" 64 "$("$gen" --run 8 0 < "$dir/heapcap.wlp4i" 2>/dev/null)"
+check "new int[1023] fits once" 1 "$("$gen" --run 1023 0 < "$dir/heapcap.wlp4i" 2>/dev/null)"
+
+# a rejected program writes nothing and fails, as it does under --batch
+tmp=${TMPDIR:-/tmp}/wlp4gen-test.$$
+rm -f "$tmp.img"
+"$gen" --link "$dir/../print.merl,$dir/../alloc.merl" -o "$tmp.img" < "$dir/badret.wlp4i" 2>/dev/null
+check "--link exits 1 on a rejected program" 1 $?
+check "--link writes no image for it" absent "$([ -e "$tmp.img" ] && echo present || echo absent)"
+rm -f "$tmp.img"
+"$gen" --merl -o "$tmp.merl" < "$dir/badret.wlp4i" 2>/dev/null
+check "--merl exits 1 on a rejected program" 1 $?
+check "--merl writes no object for it" absent "$([ -e "$tmp.merl" ] && echo present || echo absent)"
+rm -f "$tmp.merl"
+
+# --stats must not truncate its summary on a large program: one label per
+# generated procedure, and every summary line complete
+stats=$("$gen" --gen procs 20000 | "$gen" --stats 2>&1 >/dev/null)
+check "--stats labels on 20000 procs" 20000 \
+    "$(echo "$stats" | sed -n 's/^instructions .*, labels \([0-9]*\)$/\1/p')"
+check "--stats procedures on 20000 procs" 20001 \
+    "$(echo "$stats" | sed -n 's/^procedures \([0-9]*\) (.*most in one [0-9]*$/\1/p')"
+
+exit $fail
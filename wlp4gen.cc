@@ -1,29 +1,108 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <iterator>
 #include <string>
 #include <vector>
 #include <map>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 using std::stringstream;
 using std::istream;
+using std::getline;
 using std::map;
+using std::unordered_map;
+using std::unordered_set;
 using std::vector;
 using std::string;
 using std::cerr;
-using std::cout;
 using std::endl;
 using std::pair;
+using std::make_pair;
+using std::min;
 
-struct Node {
+// Productions of the WLP4 grammar. Every non-terminal line of the input is
+// mapped to one of these when it is first read; terminals are TERMINAL.
+enum Prod {
+    TERMINAL,
+    START,                  // start → BOF procedures EOF
+    PROCEDURES_MAIN,        // procedures → main
+    PROCEDURES_PROCEDURE,   // procedures → procedure procedures
+    PROCEDURE,              // procedure → INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
+    MAIN,                   // main → INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
+    PARAMS_EMPTY,           // params →
+    PARAMS_LIST,            // params → paramlist
+    PARAMLIST_DCL,          // paramlist → dcl
+    PARAMLIST_COMMA,        // paramlist → dcl COMMA paramlist
+    TYPE_INT,               // type → INT
+    TYPE_INT_STAR,          // type → INT STAR
+    DCLS_EMPTY,             // dcls →
+    DCLS_NUM,               // dcls → dcls dcl BECOMES NUM SEMI
+    DCLS_NULL,              // dcls → dcls dcl BECOMES NULL SEMI
+    DCL,                    // dcl → type ID
+    STATEMENTS_EMPTY,       // statements →
+    STATEMENTS_STATEMENT,   // statements → statements statement
+    STATEMENT_ASSIGN,       // statement → lvalue BECOMES expr SEMI
+    STATEMENT_IF,           // statement → IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE
+    STATEMENT_WHILE,        // statement → WHILE LPAREN test RPAREN LBRACE statements RBRACE
+    STATEMENT_PRINTLN,      // statement → PRINTLN LPAREN expr RPAREN SEMI
+    STATEMENT_DELETE,       // statement → DELETE LBRACK RBRACK expr SEMI
+    TEST_EQ,                // test → expr EQ expr
+    TEST_NE,                // test → expr NE expr
+    TEST_LT,                // test → expr LT expr
+    TEST_LE,                // test → expr LE expr
+    TEST_GE,                // test → expr GE expr
+    TEST_GT,                // test → expr GT expr
+    EXPR_TERM,              // expr → term
+    EXPR_PLUS,              // expr → expr PLUS term
+    EXPR_MINUS,             // expr → expr MINUS term
+    TERM_FACTOR,            // term → factor
+    TERM_STAR,              // term → term STAR factor
+    TERM_SLASH,             // term → term SLASH factor
+    TERM_PCT,               // term → term PCT factor
+    FACTOR_ID,              // factor → ID
+    FACTOR_NUM,             // factor → NUM
+    FACTOR_NULL,            // factor → NULL
+    FACTOR_PAREN,           // factor → LPAREN expr RPAREN
+    FACTOR_AMP,             // factor → AMP lvalue
+    FACTOR_STAR,            // factor → STAR factor
+    FACTOR_NEW,             // factor → NEW INT LBRACK expr RBRACK
+    FACTOR_CALL,            // factor → ID LPAREN RPAREN
+    FACTOR_CALL_ARGS,       // factor → ID LPAREN arglist RPAREN
+    ARGLIST_EXPR,           // arglist → expr
+    ARGLIST_COMMA,          // arglist → expr COMMA arglist
+    LVALUE_ID,              // lvalue → ID
+    LVALUE_STAR,            // lvalue → STAR factor
+    LVALUE_PAREN            // lvalue → LPAREN lvalue RPAREN
+};
+
+// Types of WLP4 expressions. VOID_TYPE marks nodes that have no value.
+enum Type {
+    VOID_TYPE,
+    INT_TYPE,               // int
+    PTR_TYPE                // int*
+};
+
+// Every distinct line of the input is stored once; nodes share it by pointer.
+struct Rule {
     string lhs;
     vector<string> rhs;
-    string rule;
-    vector<Node*> children;
+    Prod prod;
+    int id;                         // unique per distinct line
+    unsigned long long hash;        // of the tokens; stable across runs
     
-    void transfer(string &s) {     // split s into tokens
-        this->rule = s;
-        
+    void transfer(const string &s) {     // split s into tokens
         stringstream ss(s);
         ss >> this->lhs;
         string token;
@@ -31,964 +110,3818 @@ struct Node {
             this->rhs.push_back(token);
         }
     }
-    Node();
-    Node(string &s) {
-        this->transfer(s);
-    }
-    
-    Node(string &s, Node *n) {
-        this->transfer(s);
-        this->children.push_back(n);
-    }
+};
+
+// Nodes live in one contiguous arena (ParseTree::nodes). The children of a
+// node are stored next to each other, so they are addressed as a range
+// relative to the parent instead of through a vector of pointers.
+struct Node {
+    const Rule *rule;
+    int first;                      // offset from this node to its first child
+    unsigned char count;            // number of children
+    unsigned char prod;             // Prod of this node, TERMINAL for tokens
+    unsigned char type;             // Type of the value, set by annotate()
+    unsigned char regs;             // registers to evaluate it, 0 if it calls
     
-    Node(string &s, vector<Node*> child) {
-        this->transfer(s);
-        this->children = child;     // shallow copy
-    }
+    const string &lexeme() const { return rule->rhs[0]; }
+    int ident() const { return rule->id; }  // equal lexemes share an id
+    unsigned long numChildren() const { return count; }
+    Node *child(int i) { return this + first + i; }
+};
+
+struct ParseTree {
+    map<string, Rule> rules;        // interned input lines
+    vector<Node> nodes;             // nodes[0] is the root; freed in bulk
     
-    ~Node() {                       // delete all subtrees
-        for(vector<Node*>::iterator it=children.begin(); it != children.end(); it++) {
-            delete (*it);
-        }
-    }
+    Node *root() { return &nodes[0]; }
+};
+
+struct Symbol {
+    string name;
+    Type type;
+    int offset;                             // offset from the frame pointer
 };
 
 struct Procedure {
     string procName;
-    map<string, bool> symbolTable;
-    vector<pair<string, bool> > params;
+    vector<Type> params;                    // parameter types, in order
+    vector<Symbol> symbols;                 // parameters first, then dcls
+    unordered_map<int, int> symbolIndex;    // Node::ident() → symbols slot
+    bool reachable;                         // can be called, directly or not, from wain
+    bool leaf;                              // makes no calls, so keeps $29 and $31
 };
 
-vector<Procedure> proc;                     // a procedure
-string curProc;                             // name of current Procedure
-map<string, pair<string, int> > symTbl;    // e.g.: ID, int, -4
-map<string, map<string, pair<string, int> > > mipsMap;
+// Everything known about the program being compiled. Each compilation has
+// its own, and the threads working on it reach it through unit.
+struct Compilation {
+    vector<Procedure> proc;                 // in definition order, wain last
+    unordered_map<int, int> procIndex;      // Node::ident() → proc slot
+    unordered_map<Node *, int> constants;   // int exprs and tests known at compile time
+    unordered_set<Node *> endless;          // statements that never finish
+    
+    // Totals over the procedures generated so far, for --stats.
+    std::atomic<unsigned long> generated, cached;
+    std::atomic<unsigned long> pushes, pops, lisConstants;
+    std::atomic<long long> peepholeNanos;   // summed over the threads
+    
+    Compilation() : generated(0), cached(0), pushes(0), pops(0), lisConstants(0),
+                    peepholeNanos(0) {}
+};
 
-int framePtr = -4;
-int countWhile = 0;
-int countIf = 0;
+thread_local Compilation *unit;
 
-string term(Node *tree);
-string expr(Node *tree);
-string factor(Node *tree);
-string arglist(Node *tree);
-string lvalue(Node *tree);
-string dcl(Node *tree);
+struct Production {
+    const char *rule;
+    Prod prod;
+};
 
-void test(Node *tree);
-void statement(Node *tree);
-void dcls(Node *tree);
+const Production grammar[] = {
+    { "start BOF procedures EOF", START },
+    { "procedures main", PROCEDURES_MAIN },
+    { "procedures procedure procedures", PROCEDURES_PROCEDURE },
+    { "procedure INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE", PROCEDURE },
+    { "main INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE", MAIN },
+    { "params", PARAMS_EMPTY },
+    { "params paramlist", PARAMS_LIST },
+    { "paramlist dcl", PARAMLIST_DCL },
+    { "paramlist dcl COMMA paramlist", PARAMLIST_COMMA },
+    { "type INT", TYPE_INT },
+    { "type INT STAR", TYPE_INT_STAR },
+    { "dcls", DCLS_EMPTY },
+    { "dcls dcls dcl BECOMES NUM SEMI", DCLS_NUM },
+    { "dcls dcls dcl BECOMES NULL SEMI", DCLS_NULL },
+    { "dcl type ID", DCL },
+    { "statements", STATEMENTS_EMPTY },
+    { "statements statements statement", STATEMENTS_STATEMENT },
+    { "statement lvalue BECOMES expr SEMI", STATEMENT_ASSIGN },
+    { "statement IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE", STATEMENT_IF },
+    { "statement WHILE LPAREN test RPAREN LBRACE statements RBRACE", STATEMENT_WHILE },
+    { "statement PRINTLN LPAREN expr RPAREN SEMI", STATEMENT_PRINTLN },
+    { "statement DELETE LBRACK RBRACK expr SEMI", STATEMENT_DELETE },
+    { "test expr EQ expr", TEST_EQ },
+    { "test expr NE expr", TEST_NE },
+    { "test expr LT expr", TEST_LT },
+    { "test expr LE expr", TEST_LE },
+    { "test expr GE expr", TEST_GE },
+    { "test expr GT expr", TEST_GT },
+    { "expr term", EXPR_TERM },
+    { "expr expr PLUS term", EXPR_PLUS },
+    { "expr expr MINUS term", EXPR_MINUS },
+    { "term factor", TERM_FACTOR },
+    { "term term STAR factor", TERM_STAR },
+    { "term term SLASH factor", TERM_SLASH },
+    { "term term PCT factor", TERM_PCT },
+    { "factor ID", FACTOR_ID },
+    { "factor NUM", FACTOR_NUM },
+    { "factor NULL", FACTOR_NULL },
+    { "factor LPAREN expr RPAREN", FACTOR_PAREN },
+    { "factor AMP lvalue", FACTOR_AMP },
+    { "factor STAR factor", FACTOR_STAR },
+    { "factor NEW INT LBRACK expr RBRACK", FACTOR_NEW },
+    { "factor ID LPAREN RPAREN", FACTOR_CALL },
+    { "factor ID LPAREN arglist RPAREN", FACTOR_CALL_ARGS },
+    { "arglist expr", ARGLIST_EXPR },
+    { "arglist expr COMMA arglist", ARGLIST_COMMA },
+    { "lvalue ID", LVALUE_ID },
+    { "lvalue STAR factor", LVALUE_STAR },
+    { "lvalue LPAREN lvalue RPAREN", LVALUE_PAREN }
+};
 
-bool ifNonTerm(string &token) {
-    return (token == "start" || token == "dcl" || token == "dcls"
-            || token == "expr" || token == "factor" || token == "lvalue"
-            || token == "procedure" || token == "procedures" || token == "main"
-            || token == "params" || token == "paramlist" || token == "statement"
-            || token == "statements" || token == "term" || token == "test"
-            || token == "type" || token == "arglist");
+map<string, Prod> buildProductionIndex() {
+    map<string, Prod> index;
+    for (unsigned long i = 0; i < sizeof(grammar) / sizeof(grammar[0]); ++i) {
+        index[grammar[i].rule] = grammar[i].prod;
+    }
+    return index;
 }
 
-Node* buildTree(istream &in) {
-    string rule;
-    getline(in, rule);
-    Node *n = new Node(rule);
-    if (ifNonTerm(n->lhs)) {
-        unsigned long numChild = n->rhs.size();
-        for (int i = 0; i < numChild; ++i) {
-            n->children.push_back(buildTree(in));
-        }
+// Look up a rule (tokens joined by single spaces) in the grammar. Anything
+// that is not a production is a terminal. Batch workers call this at the
+// same time; the index is built once by a thread-safe static initializer.
+Prod findProduction(const Rule &rule) {
+    static const map<string, Prod> index = buildProductionIndex();
+    string key = rule.lhs;
+    for (unsigned long i = 0; i < rule.rhs.size(); ++i) {
+        key += " " + rule.rhs[i];
     }
-    return n;
+    map<string, Prod>::const_iterator it = index.find(key);
+    return (it == index.end() ? TERMINAL : it->second);
 }
 
-bool ifDefined(string &a, map<string, bool> &table) {
-    map<string, bool>::const_iterator it = table.find(a);
-    return it != table.end();
+unsigned long long ruleHash(const Rule &rule) {
+    unsigned long long h = 14695981039346656037ULL;     // FNV-1a
+    for (unsigned long i = 0; i <= rule.rhs.size(); ++i) {
+        const string &token = (i == 0 ? rule.lhs : rule.rhs[i - 1]);
+        for (unsigned long j = 0; j < token.size(); ++j) {
+            h = (h ^ (unsigned char)token[j]) * 1099511628211ULL;
+        }
+        h = (h ^ 0x100) * 1099511628211ULL;
+    }
+    return h;
 }
 
-bool ifProcedure(string &s) {
-    unsigned long size = proc.size();
-    for (int i = 0; i < size; ++i) {
-        if (s == proc[i].procName) return true;
+const Rule *internRule(ParseTree &tree, const string &line) {
+    map<string, Rule>::iterator it = tree.rules.find(line);
+    if (it == tree.rules.end()) {
+        it = tree.rules.insert(make_pair(line, Rule())).first;
+        it->second.transfer(line);
+        it->second.prod = findProduction(it->second);
+        it->second.id = (int)tree.rules.size() - 1;
+        it->second.hash = ruleHash(it->second);
     }
-    return false;
+    return &it->second;
 }
 
-void countParams(Node *parseTree, vector<pair <string, bool> > &curParams) {
-    string val = parseTree->lhs;
-    string err = "ERROR: Unmatched parameter";
-    if (val == "dcl") {
-        string name = parseTree->children[1]->rhs[0];
-        
-        bool ifInt = (((parseTree->children[0])->children.size() == 1) ? 1 : 0);
-        curParams.push_back(make_pair(name, ifInt));
-    }
+// Read the preorder listing into the arena. When a non-terminal is read, a
+// block for all of its children is reserved at the end of the arena and the
+// following lines fill that block (depth first), so no recursion is needed
+// even for very deep trees.
+void buildTree(istream &in, ParseTree &tree) {
+    vector<pair<int, int> > pending;        // [next, end) slots still to fill
+    string line;
     
-    if (val == "procedure") {
-        countParams(parseTree->children[3], curParams);
-    } else if (val == "main") {
-        if (dcl(parseTree->children[5]) != "int") throw err;
-        countParams(parseTree->children[3], curParams);
-        countParams(parseTree->children[5], curParams);
-    } else {
-        unsigned long children = parseTree->children.size();
-        for (int i = 0; i < children; ++i) {
-            countParams(parseTree->children[i], curParams);
+    tree.nodes.resize(1);
+    pending.push_back(make_pair(0, 1));
+    while (!pending.empty()) {
+        if (pending.back().first == pending.back().second) {
+            pending.pop_back();
+            continue;
+        }
+        int slot = pending.back().first++;
+        getline(in, line);
+        const Rule *rule = internRule(tree, line);
+        
+        tree.nodes[slot].rule = rule;
+        tree.nodes[slot].first = 0;
+        tree.nodes[slot].count = 0;
+        tree.nodes[slot].prod = rule->prod;
+        tree.nodes[slot].type = VOID_TYPE;
+        if (rule->prod != TERMINAL && !rule->rhs.empty()) {
+            int begin = (int)tree.nodes.size();
+            int numChild = (int)rule->rhs.size();
+            tree.nodes.resize(begin + numChild);
+            tree.nodes[slot].first = begin - slot;
+            tree.nodes[slot].count = numChild;
+            pending.push_back(make_pair(begin, begin + numChild));
         }
     }
 }
 
-int posProc(string &name) {
-    unsigned long len = proc.size();
-    for (int i = 0; i < len; ++i) {
-        if (name == proc[i].procName) return i;
-    }
-    return -1;
+// Slot of the variable named by the ID terminal in procedure p, or -1.
+int findSymbol(const Procedure &p, Node *id) {
+    unordered_map<int, int>::const_iterator it = p.symbolIndex.find(id->ident());
+    return (it == p.symbolIndex.end() ? -1 : it->second);
 }
 
-void test(Node *tree) {
-    string err = "ERROR: invalid test";
-    string type1 = expr(tree->children[0]);
-    string type2 = expr(tree->children[2]);
-    if (type1 != type2) throw err;
+// Slot of the procedure named by the ID terminal, or -1.
+int findProc(Node *id) {
+    unordered_map<int, int>::const_iterator it = unit->procIndex.find(id->ident());
+    return (it == unit->procIndex.end() ? -1 : it->second);
 }
 
-void statement(Node *tree) {
-    string type1, type2;
-    string err = "ERROR: Unmatched statement";
-    
-    if (tree->rhs.size() == 4) {        // lvalue BECOMES expr SEMI
-        type1 = lvalue(tree->children[0]);
-        type2 = expr(tree->children[2]);
-        if (type1 != type2) throw err;
-    } else if (tree->rhs.size() == 5) {
-        if (tree->rhs[0] == "PRINTLN") {    // PRINTLN LPAREN expr RPAREN SEMI
-            type1 = expr(tree->children[2]);
-            if (type1 != "int") throw err;
-        } else {                        // DELETE LBRACK RBRACK expr SEMI
-            type1 = expr(tree->children[3]);
-            if (type1 != "int*") throw err;
+void countParams(Node *parseTree, vector<Type> &curParams) {
+    string err = "ERROR: Unmatched parameter";
+    switch (parseTree->prod) {
+        case DCL:
+            curParams.push_back(parseTree->child(0)->prod == TYPE_INT ? INT_TYPE : PTR_TYPE);
+            break;
+        case PROCEDURE:
+            countParams(parseTree->child(3), curParams);
+            break;
+        case MAIN:
+            if (parseTree->child(5)->child(0)->prod != TYPE_INT) throw err;
+            countParams(parseTree->child(3), curParams);
+            countParams(parseTree->child(5), curParams);
+            break;
+        default: {
+            unsigned long children = parseTree->numChildren();
+            for (int i = 0; i < children; ++i) {
+                countParams(parseTree->child(i), curParams);
+            }
         }
-    } else if (tree->rhs.size() == 7) {
-        // WHILE LPAREN test RPAREN LBRACE statements RBRACE
-        test(tree->children[2]);
-        statement(tree->children[5]);
-    } else if (tree->rhs.size() == 11) {
-        // IF statement
-        test(tree->children[2]);
-        statement(tree->children[5]);
-        statement(tree->children[9]);
     }
 }
 
-string dcl(Node *tree) {
-    string type = ((tree->children[0]->rhs.size() == 1) ? "int" : "int*");
-    return type;
+Type symbolType(Node *id) {
+    int slot = findSymbol(unit->proc.back(), id);
+    if (slot == -1) {
+        string err = "ERROR: " + id->lexeme() + " is not defined";
+        throw err;
+    }
+    return unit->proc.back().symbols[slot].type;
 }
 
-void dcls(Node *tree) {
-    string type;
-    string err = "ERROR: Unmatched dcls";
-    if (tree->rhs.size() == 5) {
-        type = dcl(tree->children[1]);
-        if ((tree->rhs[3] == "NUM" && type == "int*")
-            || (tree->rhs[3] == "NULL" && type == "int")) {
-            throw err;
-        }
+int numValue(Node *num) {
+    return (int)strtoul(num->lexeme().c_str(), NULL, 10);
+}
+
+bool constantOf(Node *tree, int &value) {
+    unordered_map<Node *, int>::iterator it = unit->constants.find(tree);
+    if (it == unit->constants.end()) return false;
+    value = it->second;
+    return true;
+}
+
+// Does the statement or statements never finish?
+bool endless(Node *tree) {
+    return unit->endless.count(tree) != 0;
+}
+
+// Can tree be left unevaluated? True when it has no calls and cannot trap,
+// i.e. it neither dereferences nor divides by a value unknown here.
+bool removable(Node *tree) {
+    int value;
+    if (constantOf(tree, value)) return true;
+    switch (tree->prod) {
+    case FACTOR_ID:
+    case FACTOR_NULL:
+    case LVALUE_ID:
+        return true;
+    case EXPR_TERM:
+    case TERM_FACTOR:
+        return removable(tree->child(0));
+    case FACTOR_PAREN:
+    case FACTOR_AMP:
+    case LVALUE_PAREN:
+    case LVALUE_STAR:
+        return removable(tree->child(1));
+    case EXPR_PLUS:
+    case EXPR_MINUS:
+    case TERM_STAR:
+        return removable(tree->child(0)) && removable(tree->child(2));
+    case TERM_SLASH:
+    case TERM_PCT:
+        return removable(tree->child(0)) && constantOf(tree->child(2), value) && value != 0;
+    default:
+        return false;
     }
 }
 
-string lvalue(Node *tree) {
-    string type, symbol;
-    string err = "ERROR: Unmatched lvalue";
-    if (tree->rhs.size() == 1) {        // ID
-        symbol = tree->children[0]->rhs[0];
-        type = ((proc.back().symbolTable[symbol] == 1) ? "int" : "int*");
-    } else if (tree->rhs.size() == 2) {
-        type = factor(tree->children[1]);
-        if (type != "int*") throw err;
-        type = "int";
-    } else {
-        type = lvalue(tree->children[1]);
+// Skip the single-child links between expr, term and factor.
+Node *unwrap(Node *tree) {
+    while (tree->prod == EXPR_TERM || tree->prod == TERM_FACTOR || tree->prod == FACTOR_PAREN) {
+        tree = tree->child(tree->prod == FACTOR_PAREN ? 1 : 0);
     }
-    return type;
+    return tree;
 }
 
-string arglist(Node *tree) {
-    string type;
-    if (tree->rhs.size() == 1) {
-        type = expr(tree->children[0]);
-    } else {
-        type = expr(tree->children[0]) + " " + arglist(tree->children[2]);
+// Do a and b always evaluate to the same value? Only meaningful for
+// subtrees without calls.
+bool sameValue(Node *a, Node *b) {
+    a = unwrap(a);
+    b = unwrap(b);
+    if (a->prod != b->prod) return false;
+    switch (a->prod) {
+    case FACTOR_ID:
+    case LVALUE_ID:
+        return a->child(0)->ident() == b->child(0)->ident();
+    case FACTOR_NUM:
+        return numValue(a->child(0)) == numValue(b->child(0));
+    case FACTOR_NULL:
+        return true;
+    case FACTOR_AMP:
+    case FACTOR_STAR:
+    case LVALUE_PAREN:
+    case LVALUE_STAR:
+        return sameValue(a->child(1), b->child(1));
+    case EXPR_PLUS:
+    case EXPR_MINUS:
+    case TERM_STAR:
+    case TERM_SLASH:
+    case TERM_PCT:
+        return sameValue(a->child(0), b->child(0)) && sameValue(a->child(2), b->child(2));
+    default:
+        return false;
     }
-    return type;
 }
 
-string factor(Node *tree) {
-    string type, symbol;
-    string err = "ERROR: Unmatched factor";
-    if (tree->rhs.size() == 1) {
-        //cerr << "it is 1" << endl;
-        if (tree->rhs[0] == "ID") {
-            symbol = tree->children[0]->rhs[0];
-            int pos = posProc(curProc);
-            //cerr << curProc << ": " << pos << endl;
-            type = (proc.at(pos).symbolTable[symbol] ? "int" : "int*");
-            //cerr << "ID: " << symbol << ", type: " << type << endl;
-        } else if (tree->rhs[0] == "NUM") {
-            type = "int";
-        } else if (tree->rhs[0] == "NULL") {
-            type = "int*";
-        }
-    } else if (tree->rhs.size() == 2) {
-        if (tree->rhs[0] == "AMP") {
-            type = lvalue(tree->children[1]);
-            if (type != "int") {
-                throw err;
-            } else {
-                type = "int*";
-            }
-        } else if (tree->rhs[0] == "STAR") {
-            type = factor(tree->children[1]);
-            
-            if (type != "int*") {
-                throw err;
-            } else {
-                type = "int";
+// Record the value of an annotated expr or test (1 true, 0 false) when it
+// is known at compile time. Arithmetic wraps at 32 bits like the machine;
+// a division that would trap at run time is left alone.
+void fold(Node *tree) {
+    int l = 0, r = 0;
+    bool lc, rc;
+    switch (tree->prod) {
+    case FACTOR_NUM:
+        unit->constants[tree] = numValue(tree->child(0));
+        break;
+    case EXPR_TERM:
+    case TERM_FACTOR:
+        if (constantOf(tree->child(0), l)) unit->constants[tree] = l;
+        break;
+    case FACTOR_PAREN:
+        if (constantOf(tree->child(1), l)) unit->constants[tree] = l;
+        break;
+        
+    case EXPR_PLUS:
+    case EXPR_MINUS:
+    case TERM_STAR:
+    case TERM_SLASH:
+    case TERM_PCT:
+        lc = constantOf(tree->child(0), l);
+        rc = constantOf(tree->child(2), r);
+        if (lc && rc) {
+            unsigned int ul = (unsigned int)l, ur = (unsigned int)r;
+            if (tree->prod == EXPR_PLUS) {
+                unit->constants[tree] = (int)(ul + ur);
+            } else if (tree->prod == EXPR_MINUS) {
+                unit->constants[tree] = (int)(ul - ur);
+            } else if (tree->prod == TERM_STAR) {
+                unit->constants[tree] = (int)(ul * ur);
+            } else if (r != 0 && !(l == INT_MIN && r == -1)) {
+                unit->constants[tree] = (tree->prod == TERM_SLASH ? l / r : l % r);
             }
+        } else if ((tree->prod == TERM_STAR && ((lc && l == 0) || (rc && r == 0))) ||
+                   (tree->prod == TERM_PCT && rc && (r == 1 || r == -1)) ||
+                   (tree->prod == EXPR_MINUS && sameValue(tree->child(0), tree->child(2)))) {
+            // x*0, 0*x, x%1, x%-1 and x-x. Matched before removable() walks
+            // the operands, or every link of a long chain would walk it.
+            if (removable(tree->child(0)) && removable(tree->child(2))) unit->constants[tree] = 0;
         }
-    } else if (tree->rhs.size() == 3) {
-        if (tree->rhs[0] == "LPAREN") {
-            type = expr(tree->children[1]);
-        } else if (tree->rhs[0] == "ID") {
-            // return type of a procedure is INT
-            type = "int";
-        }
-    } else if (tree->rhs.size() == 4) {
-        // find the position of ID
-        int pos = posProc(tree->children[0]->rhs[0]);
-        if (pos == -1) throw err;
-        
-        symbol = arglist(tree->children[2]);
-        //cerr << "symbol is " << symbol << endl;
+        break;
         
-        stringstream ss(symbol);
-        unsigned long len = proc.at(pos).params.size();
-        for (int i = 0; i < len; ++i) {
-            if (! (ss >> type)) throw err;
-            bool boolType = proc.at(pos).params[i].second;
-            symbol = (boolType ? "int" : "int*");
-            if (type != symbol) throw err;
+    case TEST_EQ:
+    case TEST_NE:
+    case TEST_LT:
+    case TEST_LE:
+    case TEST_GE:
+    case TEST_GT: {
+        int cmp;                            // sign of left - right
+        if (constantOf(tree->child(0), l) && constantOf(tree->child(2), r)) {
+            cmp = (l < r ? -1 : (l > r ? 1 : 0));
+        } else if (sameValue(tree->child(0), tree->child(2)) && removable(tree->child(0))) {
+            cmp = 0;
+        } else {
+            break;
         }
-        
-        if (ss >> type) throw err;
-        type = "int";
-    } else if (tree->rhs.size() == 5) {
-        type = expr(tree->children[3]);
-        if (type != "int") throw err;
-        type = "int*";
+        bool result = false;
+        switch (tree->prod) {
+        case TEST_EQ: result = (cmp == 0); break;
+        case TEST_NE: result = (cmp != 0); break;
+        case TEST_LT: result = (cmp < 0); break;
+        case TEST_LE: result = (cmp <= 0); break;
+        case TEST_GE: result = (cmp >= 0); break;
+        default:      result = (cmp > 0); break;
+        }
+        unit->constants[tree] = (result ? 1 : 0);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Sethi–Ullman number of an expression whose children are annotated: the
+// registers needed to evaluate it without spilling. 0 when it contains a
+// call, since a call clobbers every register.
+unsigned char regNeed(Node *tree) {
+    int l, r;
+    if (unit->constants.count(tree) != 0) return 1;
+    switch (tree->prod) {
+    case FACTOR_ID:
+    case FACTOR_NUM:
+    case FACTOR_NULL:
+    case LVALUE_ID:
+        return 1;
+    case EXPR_TERM:
+    case TERM_FACTOR:
+        return tree->child(0)->regs;
+    case FACTOR_PAREN:
+    case FACTOR_AMP:
+    case FACTOR_STAR:
+    case LVALUE_PAREN:
+    case LVALUE_STAR:
+        return tree->child(1)->regs;
+    case EXPR_PLUS:
+    case EXPR_MINUS:
+    case TERM_STAR:
+    case TERM_SLASH:
+    case TERM_PCT:
+        l = tree->child(0)->regs;
+        r = tree->child(2)->regs;
+        if (l == 0 || r == 0) return 0;
+        if (l != r) return (unsigned char)(l > r ? l : r);
+        return (unsigned char)(l < 255 ? l + 1 : l);
+    default:
+        return 0;
     }
-    return type;
 }
 
-string term(Node *tree) {
-    string type1, type2;
-    string err = "ERROR: Unmatched term";
-    if (tree->rhs.size() == 1) {
-        return factor(tree->children[0]);
-    } else if (tree->rhs[1] == "STAR") {
-        type1 = term(tree->children[0]);
-        type2 = factor(tree->children[2]);
-        if (type1 != type2 || type1 != "int") throw err;
-    } else if (tree->rhs[1] == "SLASH") {
-        type1 = term(tree->children[0]);
-        type2 = factor(tree->children[2]);
-        if (type1 != type2 || type1 != "int") throw err;
-    } else if (tree->rhs[1] == "PCT") {
-        type1 = term(tree->children[0]);
-        type2 = factor(tree->children[2]);
-        if (type1 != type2 || type1 != "int") throw err;
-    }
-    return type1;
-}
-
-string expr(Node *tree) {              // check expr
-    string type, type1, type2;
-    string err = "ERROR: Unmatched expr";
-    if (tree->rhs.size() == 1) {
-        return term(tree->children[0]);
-    } else if (tree->rhs[1] == "PLUS") {
-        type1 = expr(tree->children[0]);
-        type2 = term(tree->children[2]);
+// Type check a subtree of the procedure being built (proc.back()) bottom-up
+// and record the type of every expr, term, factor and lvalue in Node::type,
+// so code generation reads it instead of re-typing subtrees.
+Type annotate(Node *tree) {
+    Type type = VOID_TYPE;
+    Type type1, type2;
+    string err;
+    
+    switch (tree->prod) {
+    case DCLS_NUM:                          // dcls → dcls dcl BECOMES NUM SEMI
+    case DCLS_NULL: {                       // dcls → dcls dcl BECOMES NULL SEMI
+        annotate(tree->child(0));
+        bool ifInt = (tree->child(1)->child(0)->prod == TYPE_INT);
+        if (ifInt != (tree->prod == DCLS_NUM)) {
+            err = "ERROR: Unmatched dcls";
+            throw err;
+        }
+        break;
+    }
+    case STATEMENTS_STATEMENT:
+        annotate(tree->child(0));
+        annotate(tree->child(1));
+        if (endless(tree->child(0)) || endless(tree->child(1))) unit->endless.insert(tree);
+        break;
+    case STATEMENT_ASSIGN:                  // lvalue BECOMES expr SEMI
+        if (annotate(tree->child(0)) != annotate(tree->child(2))) {
+            err = "ERROR: Unmatched statement";
+            throw err;
+        }
+        break;
+    case STATEMENT_PRINTLN:                 // PRINTLN LPAREN expr RPAREN SEMI
+        if (annotate(tree->child(2)) != INT_TYPE) {
+            err = "ERROR: Unmatched statement";
+            throw err;
+        }
+        break;
+    case STATEMENT_DELETE:                  // DELETE LBRACK RBRACK expr SEMI
+        if (annotate(tree->child(3)) != PTR_TYPE) {
+            err = "ERROR: Unmatched statement";
+            throw err;
+        }
+        break;
+    case STATEMENT_WHILE: {
+        annotate(tree->child(2));
+        annotate(tree->child(5));
+        int known;                          // there is no way out of while (1)
+        if (constantOf(tree->child(2), known) && known != 0) unit->endless.insert(tree);
+        break;
+    }
+    case STATEMENT_IF: {
+        annotate(tree->child(2));
+        annotate(tree->child(5));
+        annotate(tree->child(9));
+        int known;
+        bool stuck = (constantOf(tree->child(2), known) ? endless(tree->child(known ? 5 : 9)) :
+                      endless(tree->child(5)) && endless(tree->child(9)));
+        if (stuck) unit->endless.insert(tree);
+        break;
+    }
+        
+    case TEST_EQ:
+    case TEST_NE:
+    case TEST_LT:
+    case TEST_LE:
+    case TEST_GE:
+    case TEST_GT:
+        if (annotate(tree->child(0)) != annotate(tree->child(2))) {
+            err = "ERROR: invalid test";
+            throw err;
+        }
+        break;
+        
+    case EXPR_TERM:
+    case TERM_FACTOR:
+        type = annotate(tree->child(0));
+        break;
+    case EXPR_PLUS:
+        type1 = annotate(tree->child(0));
+        type2 = annotate(tree->child(2));
         if (type1 != type2) {
-            type = "int*";
-        } else if (type1 == "int" && type2 == "int") {
-            type = "int";
+            type = PTR_TYPE;
+        } else if (type1 == INT_TYPE) {
+            type = INT_TYPE;
         } else {
+            err = "ERROR: Unmatched expr";
             throw err;
         }
-    } else if (tree->rhs[1] == "MINUS") {
-        type1 = expr(tree->children[0]);
-        type2 = term(tree->children[2]);
+        break;
+    case EXPR_MINUS:
+        type1 = annotate(tree->child(0));
+        type2 = annotate(tree->child(2));
         if (type1 == type2) {
-            type = "int";
-        } else if (type1 == "int*" && type2 == "int") {
-            type = "int*";
+            type = INT_TYPE;
+        } else if (type1 == PTR_TYPE && type2 == INT_TYPE) {
+            type = PTR_TYPE;
         } else {
+            err = "ERROR: Unmatched expr";
+            throw err;
+        }
+        break;
+    case TERM_STAR:
+    case TERM_SLASH:
+    case TERM_PCT:
+        type1 = annotate(tree->child(0));
+        type2 = annotate(tree->child(2));
+        if (type1 != INT_TYPE || type2 != INT_TYPE) {
+            err = "ERROR: Unmatched term";
+            throw err;
+        }
+        type = INT_TYPE;
+        break;
+        
+    case FACTOR_ID:
+    case LVALUE_ID:
+        type = symbolType(tree->child(0));
+        break;
+    case FACTOR_NUM:
+        type = INT_TYPE;
+        break;
+    case FACTOR_NULL:
+        type = PTR_TYPE;
+        break;
+    case FACTOR_PAREN:
+    case LVALUE_PAREN:
+        type = annotate(tree->child(1));
+        break;
+    case FACTOR_AMP:
+        if (annotate(tree->child(1)) != INT_TYPE) {
+            err = "ERROR: Unmatched factor";
+            throw err;
+        }
+        type = PTR_TYPE;
+        break;
+    case FACTOR_STAR:
+    case LVALUE_STAR:
+        if (annotate(tree->child(1)) != PTR_TYPE) {
+            err = "ERROR: Unmatched factor";
+            throw err;
+        }
+        type = INT_TYPE;
+        break;
+    case FACTOR_NEW:
+        if (annotate(tree->child(3)) != INT_TYPE) {
+            err = "ERROR: Unmatched factor";
             throw err;
         }
+        type = PTR_TYPE;
+        break;
+    case FACTOR_CALL:
+    case FACTOR_CALL_ARGS: {
+        // match the arguments against the parameters of the callee
+        int pos = findProc(tree->child(0));
+        err = "ERROR: Unmatched factor";
+        if (pos == -1) throw err;
+        
+        vector<Type> &params = unit->proc[pos].params;
+        Node *args = (tree->prod == FACTOR_CALL_ARGS ? tree->child(2) : NULL);
+        for (unsigned long i = 0; i < params.size(); ++i) {
+            if (args == NULL) throw err;
+            if (annotate(args->child(0)) != params[i]) throw err;
+            args = (args->prod == ARGLIST_COMMA ? args->child(2) : NULL);
+        }
+        if (args != NULL) throw err;
+        
+        // return type of a procedure is INT
+        type = INT_TYPE;
+        break;
+    }
+    default:
+        break;
     }
+    
+    tree->type = type;
+    fold(tree);
+    tree->regs = regNeed(tree);
     return type;
 }
 
 void procSymbolTable(Node *parseTree) {
-    string val = parseTree->lhs;
-    string name;
-    if (val == "dcl") {             // can only be "dcl type ID"
-        name = parseTree->children[1]->rhs[0];
-        //cerr << "name is " << name << endl;
-        if (ifDefined(name, proc.back().symbolTable)) {
-            cerr << "ERROR: " << name << " is defined" << endl;
-            return;
+    Procedure &cur = unit->proc.back();
+    if (parseTree->prod == DCL) {             // can only be "dcl type ID"
+        Node *id = parseTree->child(1);
+        if (findSymbol(cur, id) != -1) {
+            string err = "ERROR: " + id->lexeme() + " is defined";
+            throw err;
         }
-        //cerr << "add name " << name << endl;
-        bool ifInt = (((parseTree->children[0])->children.size() == 1) ? 1 : 0);
-        proc.back().symbolTable[name] = ifInt;
+        Symbol sym;
+        sym.name = id->lexeme();
+        sym.type = (parseTree->child(0)->prod == TYPE_INT ? INT_TYPE : PTR_TYPE);
+        sym.offset = -4 * ((int)cur.symbols.size() + 1);
+        cur.symbolIndex[id->ident()] = (int)cur.symbols.size();
+        cur.symbols.push_back(sym);
         return;
     }
     
-    if (val == "ID") {
-        string name = parseTree->rhs[0];   // only one element in the rhs
-        if (!ifDefined(name, proc.back().symbolTable)) {
-            cerr << "ERROR: " << name << " is not defined" << endl;
-            return;
+    if (parseTree->prod == FACTOR_ID || parseTree->prod == LVALUE_ID) {
+        if (findSymbol(cur, parseTree->child(0)) == -1) {
+            string err = "ERROR: " + parseTree->child(0)->lexeme() + " is not defined";
+            throw err;
         }
+        return;
     }
     
-    /* Skip error checking since the given tests are error-free
-     if (val == "expr") expr(parseTree);
-     if (val == "statement") statement(parseTree);
-     if (val == "dcls") dcls(parseTree);*/
+    // types are checked afterwards by annotate()
     
-    unsigned long children = parseTree->children.size();
+    unsigned long children = parseTree->numChildren();
     int i = 0;
     
-    if (val == "factor" && parseTree->rhs[0] == "ID"
-        && parseTree->rhs.size() > 1) {
-        if (ifDefined(parseTree->children[0]->rhs[0], proc.back().symbolTable)) {
+    if (parseTree->prod == FACTOR_CALL || parseTree->prod == FACTOR_CALL_ARGS ||
+        parseTree->prod == FACTOR_NEW || parseTree->prod == STATEMENT_PRINTLN ||
+        parseTree->prod == STATEMENT_DELETE) {
+        cur.leaf = false;                     // jalr overwrites $31
+    }
+    if (parseTree->prod == FACTOR_CALL || parseTree->prod == FACTOR_CALL_ARGS) {
+        if (findSymbol(cur, parseTree->child(0)) != -1) {
             string err = "ERROR: Use variable as function";
             throw err;
         }
-        if (ifProcedure(parseTree->children[0]->rhs[0])) {  // it is defined
+        if (findProc(parseTree->child(0)) != -1) {  // it is defined
             i += 1;
         } else {
-            cerr << "ERROR: function not defined" << endl;
-            return;
+            string err = "ERROR: function not defined";
+            throw err;
         }
     }
-    if (val == "procedure") i = 2;
+    if (parseTree->prod == PROCEDURE) i = 2;
     for (; i < children; ++i) {
-        procSymbolTable(parseTree->children[i]);
+        procSymbolTable(parseTree->child(i));
+    }
+}
+
+// The frame pointer is $30 on entry. Parameters are just below it, then a
+// procedure that calls out saves the caller's $29 and its $31, then the
+// locals follow.
+void layoutFrame(Procedure &p) {
+    if (p.leaf) return;
+    for (unsigned long i = p.params.size(); i < p.symbols.size(); ++i) {
+        p.symbols[i].offset -= 8;
     }
 }
 
 void buildSymbolTable(Node *parseTree) {
-    string val = parseTree->lhs;
     string name, err;
     
-    if (val == "procedure") {
-        if (ifProcedure(parseTree->children[1]->rhs[0])) {
+    // The procedures chain is as long as the program; walk it in a loop.
+    while (parseTree->prod == PROCEDURES_PROCEDURE) {
+        buildSymbolTable(parseTree->child(0));
+        parseTree = parseTree->child(1);
+    }
+    
+    if (parseTree->prod == PROCEDURE) {
+        if (findProc(parseTree->child(1)) != -1) {
             err = "ERROR: procedure is defined";
             throw err;
         }
         
         Procedure newProc;
-        curProc = parseTree->children[1]->rhs[0];
-        newProc.procName = curProc;
-        vector<pair <string, bool> > curParams;
-        countParams(parseTree, curParams);
-        newProc.params = curParams;
-        proc.push_back(newProc);
+        newProc.procName = parseTree->child(1)->lexeme();
+        newProc.reachable = false;
+        newProc.leaf = true;
+        countParams(parseTree, newProc.params);
+        unit->procIndex[parseTree->child(1)->ident()] = (int)unit->proc.size();
+        unit->proc.push_back(newProc);
         procSymbolTable(parseTree);
-        if ("int" != expr(parseTree->children[9])) {
+        layoutFrame(unit->proc.back());
+        annotate(parseTree->child(6));
+        annotate(parseTree->child(7));
+        if (annotate(parseTree->child(9)) != INT_TYPE) {
             err = "ERROR: Wrong return type";
             throw err;
         }
         return;
     }
     
-    if (val == "main") {
-        if (ifProcedure(parseTree->children[1]->rhs[0])) {
+    if (parseTree->prod == MAIN) {
+        if (findProc(parseTree->child(1)) != -1) {
             err = "ERROR: procedure is defined";
             throw err;
         }
         
         Procedure newProc;
-        curProc = "wain";
         newProc.procName = "wain";
-        vector<pair <string, bool> > curParams;
-        countParams(parseTree, curParams);
-        newProc.params = curParams;
-        proc.push_back(newProc);
+        newProc.reachable = false;
+        newProc.leaf = false;                   // wain calls init
+        countParams(parseTree, newProc.params);
+        unit->procIndex[parseTree->child(1)->ident()] = (int)unit->proc.size();
+        unit->proc.push_back(newProc);
         procSymbolTable(parseTree);
-        if ("int" != expr(parseTree->children[11])) {
+        layoutFrame(unit->proc.back());
+        annotate(parseTree->child(8));
+        annotate(parseTree->child(9));
+        if (annotate(parseTree->child(11)) != INT_TYPE) {
             err = "ERROR: Wrong return type";
             throw err;
         }
         return;
     }
     
-    unsigned long children = parseTree->children.size();
+    unsigned long children = parseTree->numChildren();
     int i = 0;
     
     for (; i < children; ++i) {
-        buildSymbolTable(parseTree->children[i]);
+        buildSymbolTable(parseTree->child(i));
+    }
+}
+
+// Add the procedures called by the code generated for tree to callees.
+// Branches that cannot be taken and statements after one that never
+// finishes get no code, so their calls do not count.
+void findCalls(Node *tree, vector<int> &callees) {
+    int known;
+    switch (tree->prod) {
+    case PROCEDURE:
+    case MAIN: {
+        int body = (tree->prod == MAIN ? 9 : 7);
+        findCalls(tree->child(body), callees);
+        if (!endless(tree->child(body))) findCalls(tree->child(body + 2), callees);
+        return;
+    }
+    case STATEMENTS_STATEMENT:
+        findCalls(tree->child(0), callees);
+        if (!endless(tree->child(0))) findCalls(tree->child(1), callees);
+        return;
+    case STATEMENT_WHILE:
+        if (constantOf(tree->child(2), known) && known == 0) return;
+        break;
+    case STATEMENT_IF:
+        if (constantOf(tree->child(2), known)) {
+            findCalls(tree->child(known ? 5 : 9), callees);
+            return;
+        }
+        break;
+    case FACTOR_CALL:
+    case FACTOR_CALL_ARGS:
+        callees.push_back(findProc(tree->child(0)));
+        break;
+    default:
+        if (unit->constants.count(tree) != 0) return;   // no code at all
+        break;
+    }
+    unsigned long children = tree->numChildren();
+    for (unsigned long i = 0; i < children; ++i) findCalls(tree->child(i), callees);
+}
+
+// Mark the procedures that wain can reach through calls; generate() leaves
+// the rest out.
+void markReachable(Node *procedures) {
+    vector<Node *> procNode(unit->proc.size());
+    for (Node *node = procedures; ; node = node->child(1)) {
+        procNode[findProc(node->child(0)->child(1))] = node->child(0);
+        if (node->prod == PROCEDURES_MAIN) break;
+    }
+    vector<int> work(1, (int)unit->proc.size() - 1);  // wain
+    unit->proc.back().reachable = true;
+    while (!work.empty()) {
+        Node *tree = procNode[work.back()];
+        work.pop_back();
+        vector<int> callees;
+        findCalls(tree, callees);
+        for (unsigned long i = 0; i < callees.size(); ++i) {
+            Procedure &callee = unit->proc[callees[i]];
+            if (callee.reachable) continue;
+            callee.reachable = true;
+            work.push_back(callees[i]);
+        }
     }
 }
 
 void printSymbolTable() {
-    unsigned long procSize = proc.size();
+    unsigned long procSize = unit->proc.size();
     for (int i = 0; i < procSize; ++i) {
         if (i != 0) cerr << '\n';
         
-        cerr << proc[i].procName;
+        cerr << unit->proc[i].procName;
         
         // print parameters
-        unsigned long len = proc[i].params.size();
+        unsigned long len = unit->proc[i].params.size();
         for (int j = 0; j < len; ++j) {
-            string t = (proc[i].params[j].second ? "int" : "int*");
-            cerr << " " <<  t;
+            cerr << " " << (unit->proc[i].params[j] == INT_TYPE ? "int" : "int*");
         }
         cerr << '\n';
-        //cerr << proc[0].symbolTable.size() << endl;
         // print symbol table
-        map<string, bool>::iterator it;
-        for (it = proc[i].symbolTable.begin(); it != proc[i].symbolTable.end(); it++) {
-            //cerr << "count " << endl;
-            string t = (it->second ? "int" : "int*");
-            cerr << it->first << " " << t << endl;
+        len = unit->proc[i].symbols.size();
+        for (int j = 0; j < len; ++j) {
+            Symbol &sym = unit->proc[i].symbols[j];
+            cerr << sym.name << " " << (sym.type == INT_TYPE ? "int" : "int*")
+                 << " " << sym.offset << endl;
         }
     }
 }
 
 // Generate mips file
 
-string lvalueStr(Node *node) {
-    if (node->rhs.size() == 1) {
-        return node->children[0]->rhs[0];
-    } else {
-        return lvalueStr(node->children[1]);
+enum Opcode {
+    OP_ADD, OP_SUB, OP_SLT, OP_SLTU,        // $d = $s op $t
+    OP_MULT, OP_MULTU, OP_DIV, OP_DIVU,     // hi:lo = $s op $t
+    OP_MFHI, OP_MFLO,                       // $d = hi, $d = lo
+    OP_LIS,                                 // $d = imm, or the address of label
+    OP_LW, OP_SW,                           // $t = mem[$s + imm], mem[$s + imm] = $t
+    OP_BEQ, OP_BNE,                         // branch to label if $s == / != $t
+    OP_JR, OP_JALR,                         // jump to $s, jalr links in $31
+    OP_LABEL                                // defines label; not an instruction
+};
+
+const char *const opNames[] = {
+    "add", "sub", "slt", "sltu", "mult", "multu", "div", "divu",
+    "mfhi", "mflo", "lis", "lw", "sw", "beq", "bne", "jr", "jalr", ""
+};
+
+// One instruction of the generated program. OP_LIS stands for the pair
+// "lis $d" / ".word imm-or-label", so it occupies two words in memory.
+struct Instr {
+    unsigned char op;
+    unsigned char d, s, t;                  // register operands
+    int imm;                                // constant or lw/sw offset
+    int label;                              // index into Program::labels, or -1
+    int source;                             // index into Program::sources, or -1
+};
+
+// What generated code belongs to, for the profiler.
+enum SourceKind {
+    SRC_ENTRY,                              // prologue, dcls and epilogue
+    SRC_ASSIGN, SRC_PRINTLN, SRC_DELETE, SRC_WHILE, SRC_IF, SRC_RETURN
+};
+
+const char *const sourceNames[] = {
+    "entry", "assign", "println", "delete", "while", "if", "return"
+};
+
+struct Source {
+    int proc;                               // index into Program::procs
+    int kind;                               // SourceKind
+    int number;                             // statement number in the procedure
+    int label;                              // while and if: their first label
+    int parent;                             // enclosing while or if, or -1
+};
+
+struct Program {
+    vector<Instr> code;
+    vector<string> labels;                  // label names
+    vector<int> imports;                    // labels defined by the runtime
+    vector<string> procs;                   // procedure names
+    vector<Source> sources;
+    
+    int newLabel(const string &name) {
+        labels.push_back(name);
+        return (int)labels.size() - 1;
+    }
+};
+
+// State of generating one procedure. Procedures are generated
+// independently, each by a worker thread using its own context.
+struct CodeGen {
+    Program prog;
+    int curProc;                            // index of the procedure
+    int frameReg;                           // $29, or $28 or $30 in a leaf
+    vector<int> varRegs;                    // symbol slot → register holding it, or -1
+    int temps;                              // pool registers left for expressions
+    int countWhile, countIf, countSkip;
+    unordered_map<int, int> procLabels;     // proc index → label in prog
+    unsigned long pushes, pops, lisConstants;       // calls, for --stats
+    int curSource;                          // statement being generated
+    int countStatement;
+};
+
+thread_local CodeGen *gen;                  // context of the calling thread
+
+// Assembly text is collected in memory and written out in one piece at the
+// end, instead of going through a flushed stream for every line.
+struct Emitter {
+    string buf;
+    
+    Emitter &operator<<(const char *s) { buf += s; return *this; }
+    Emitter &operator<<(const string &s) { buf += s; return *this; }
+    Emitter &operator<<(char c) { buf += c; return *this; }
+    Emitter &operator<<(int n) {
+        char digits[10];
+        int len = 0;
+        unsigned int u = (n < 0 ? 0u - (unsigned int)n : (unsigned int)n);
+        do {
+            digits[len++] = (char)('0' + u % 10);
+            u /= 10;
+        } while (u != 0);
+        if (n < 0) buf += '-';
+        while (len > 0) buf += digits[--len];
+        return *this;
+    }
+    Emitter &operator<<(unsigned long n) {
+        char digits[24];
+        snprintf(digits, sizeof(digits), "%lu", n);
+        buf += digits;
+        return *this;
+    }
+    
+    bool writeTo(FILE *f) {
+        return fwrite(buf.data(), 1, buf.size(), f) == buf.size() && fflush(f) == 0;
+    }
+};
+
+// Render the program as assembly text.
+void printProgram(const Program &p, Emitter &out) {
+    for (unsigned long i = 0; i < p.imports.size(); ++i) {
+        out << ".import " << p.labels[p.imports[i]] << '\n';
+    }
+    unsigned long len = p.code.size();
+    for (unsigned long i = 0; i < len; ++i) {
+        const Instr &in = p.code[i];
+        switch (in.op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_SLT:
+        case OP_SLTU:
+            out << opNames[in.op] << " $" << in.d << ", $" << in.s << ", $" << in.t;
+            break;
+        case OP_MULT:
+        case OP_MULTU:
+        case OP_DIV:
+        case OP_DIVU:
+            out << opNames[in.op] << " $" << in.s << ", $" << in.t;
+            break;
+        case OP_MFHI:
+        case OP_MFLO:
+            out << opNames[in.op] << " $" << in.d;
+            break;
+        case OP_LIS:
+            out << "lis $" << in.d << "\n.word ";
+            if (in.label != -1) {
+                out << p.labels[in.label];
+            } else {
+                out << in.imm;
+            }
+            break;
+        case OP_LW:
+        case OP_SW:
+            out << opNames[in.op] << " $" << in.t << ", " << in.imm << "($" << in.s << ")";
+            break;
+        case OP_BEQ:
+        case OP_BNE:
+            out << opNames[in.op] << " $" << in.s << ", $" << in.t << ", " << p.labels[in.label];
+            break;
+        case OP_JR:
+        case OP_JALR:
+            out << opNames[in.op] << " $" << in.s;
+            break;
+        case OP_LABEL:
+            if (i > 0 && p.code[i - 1].op == OP_JR) out << '\n';
+            out << p.labels[in.label] << ':';
+            break;
+        }
+        out << '\n';
     }
 }
 
-void init() {
-    cout << ".import print" << endl;
-    cout << ".import init" << endl;
-    cout << ".import new" << endl;
-    cout << ".import delete" << endl;
-    cout << "; Initialization: " << endl;
-    cout << "lis $4" << '\n' << ".word 4" << endl;
-    cout << "lis $15" << '\n' << ".word print" << endl;
-    cout << "lis $16" << '\n' << ".word init" << endl;
-    cout << "lis $17" << '\n' << ".word new" << endl;
-    cout << "lis $18" << '\n' << ".word delete" << endl;
-    cout << "lis $11" << '\n' << ".word 1" << endl;
-    cout << "add $29, $30, $0" << endl;
+// Where the labels defined in p fall when its code starts at base: labels
+// take no space and lis takes two words. Labels never placed are left at
+// noAddress. Returns the address just past the code.
+const unsigned int noAddress = 0xffffffff;
+
+unsigned int layoutLabels(const Program &p, unsigned int base, vector<unsigned int> &labelAddr) {
+    labelAddr.assign(p.labels.size(), noAddress);
+    unsigned int addr = base;
+    for (unsigned long i = 0; i < p.code.size(); ++i) {
+        const Instr &in = p.code[i];
+        if (in.op == OP_LABEL) {
+            labelAddr[in.label] = addr;
+        } else {
+            addr += (in.op == OP_LIS ? 8 : 4);
+        }
+    }
+    return addr;
+}
+
+// Function field of the R-type instructions, opcode of the others.
+const unsigned int opCodes[] = {
+    0x20, 0x22, 0x2a, 0x2b, 0x18, 0x19, 0x1a, 0x1b,
+    0x10, 0x12, 0x14, 0x23, 0x2b, 0x04, 0x05, 0x08, 0x09, 0
+};
+
+const unsigned int merlCookie = 0x10000002;     // beq $0, $0, 2 over the header
+const unsigned int merlHeader = 12;             // cookie, module end, code end
+const unsigned int merlRel = 0x01, merlEsr = 0x11, merlEsd = 0x05;
+
+// Assemble p into the words of a MERL object: the header, the code, then a
+// REL entry for each word holding the address of one of p's labels and an
+// ESR entry for each word holding an import's.
+void encodeMerl(const Program &p, vector<unsigned int> &words) {
+    string err;
+    vector<unsigned int> labelAddr;
+    unsigned int codeEnd = layoutLabels(p, merlHeader, labelAddr);
+    vector<bool> imported(p.labels.size(), false);
+    for (unsigned long i = 0; i < p.imports.size(); ++i) imported[p.imports[i]] = true;
+    
+    words.clear();
+    words.reserve(codeEnd / 4 + 64);
+    words.push_back(merlCookie);
+    words.push_back(0);                     // module end, known at the end
+    words.push_back(codeEnd);
+    vector<unsigned int> rel;               // addresses of words to relocate
+    vector<pair<unsigned int, int> > esr;   // address, import label
+    for (unsigned long i = 0; i < p.code.size(); ++i) {
+        const Instr &in = p.code[i];
+        unsigned int addr = 4 * (unsigned int)words.size();
+        unsigned int code = opCodes[in.op];
+        unsigned int dest = (in.label == -1 ? 0 : labelAddr[in.label]);
+        if (in.label != -1 && dest == noAddress && !imported[in.label]) {
+            err = "ERROR: label " + p.labels[in.label] + " is not defined";
+            throw err;
+        }
+        switch (in.op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_SLT:
+        case OP_SLTU:
+            words.push_back((in.s << 21) | (in.t << 16) | (in.d << 11) | code);
+            break;
+        case OP_MULT:
+        case OP_MULTU:
+        case OP_DIV:
+        case OP_DIVU:
+            words.push_back((in.s << 21) | (in.t << 16) | code);
+            break;
+        case OP_MFHI:
+        case OP_MFLO:
+            words.push_back((in.d << 11) | code);
+            break;
+        case OP_LIS:
+            words.push_back((in.d << 11) | code);
+            if (in.label == -1) {
+                words.push_back((unsigned int)in.imm);
+            } else if (imported[in.label]) {
+                esr.push_back(make_pair(addr + 4, in.label));
+                words.push_back(0);
+            } else {
+                rel.push_back(addr + 4);
+                words.push_back(dest);
+            }
+            break;
+        case OP_LW:
+        case OP_SW:
+            if (in.imm < -32768 || in.imm > 32767) {
+                err = string("ERROR: ") + opNames[in.op] + " offset out of range";
+                throw err;
+            }
+            words.push_back((code << 26) | (in.s << 21) | (in.t << 16) | (in.imm & 0xffff));
+            break;
+        case OP_BEQ:
+        case OP_BNE: {
+            int offset = ((int)dest - (int)(addr + 4)) / 4;
+            if (offset < -32768 || offset > 32767) {
+                err = "ERROR: branch to " + p.labels[in.label] + " out of range";
+                throw err;
+            }
+            words.push_back((code << 26) | (in.s << 21) | (in.t << 16) | (offset & 0xffff));
+            break;
+        }
+        case OP_JR:
+        case OP_JALR:
+            words.push_back((in.s << 21) | code);
+            break;
+        default:
+            break;
+        }
+    }
+    
+    for (unsigned long i = 0; i < rel.size(); ++i) {
+        words.push_back(merlRel);
+        words.push_back(rel[i]);
+    }
+    for (unsigned long i = 0; i < esr.size(); ++i) {
+        const string &name = p.labels[esr[i].second];
+        words.push_back(merlEsr);
+        words.push_back(esr[i].first);
+        words.push_back((unsigned int)name.size());
+        for (unsigned long k = 0; k < name.size(); ++k) words.push_back((unsigned char)name[k]);
+    }
+    words[1] = 4 * (unsigned int)words.size();
 }
 
-void typeR(string instr, int f, int s, int t) {
-    cout << instr << " $" << f;
-    if (s != -1) {
-        cout << ", $" << s;
-        if (t != -1) {
-            cout << ", $" << t;
+// A MERL object taken apart for linking. Addresses are as in the file, so
+// they count the header.
+struct MerlModule {
+    string name;                            // for messages
+    vector<unsigned int> code;
+    vector<unsigned int> rel;               // words holding module addresses
+    vector<pair<unsigned int, string> > esr;        // words holding an import
+    vector<pair<string, unsigned int> > esd;        // exported addresses
+};
+
+// Take the words of a MERL object apart into m. Throws if they are not one.
+void parseMerl(const vector<unsigned int> &words, MerlModule &m) {
+    string err = "ERROR: " + m.name + " is not a MERL object";
+    if (words.size() < 3 || words[0] != merlCookie || words[1] != 4 * words.size() ||
+        words[2] < merlHeader || words[2] > words[1] || words[2] % 4 != 0) {
+        throw err;
+    }
+    unsigned int codeEnd = words[2];
+    m.code.assign(words.begin() + 3, words.begin() + codeEnd / 4);
+    for (unsigned long i = codeEnd / 4; i < words.size(); ) {
+        unsigned int type = words[i];
+        if (i + 1 >= words.size()) throw err;
+        unsigned int addr = words[i + 1];
+        bool inCode = (addr >= merlHeader && addr < codeEnd && addr % 4 == 0);
+        if (type == merlRel) {
+            if (!inCode) throw err;
+            m.rel.push_back(addr);
+            i += 2;
+        } else if (type == merlEsr || type == merlEsd) {
+            if (i + 2 >= words.size() || words[i + 2] > words.size() - i - 3) throw err;
+            if (type == merlEsr && !inCode) throw err;
+            string name;
+            for (unsigned int k = 0; k < words[i + 2]; ++k) name += (char)words[i + 3 + k];
+            if (type == merlEsr) {
+                m.esr.push_back(make_pair(addr, name));
+            } else {
+                m.esd.push_back(make_pair(name, addr));
+            }
+            i += 3 + words[i + 2];
+        } else {
+            throw err;
         }
     }
-    cout << '\n';
 }
 
-void typeI_offset(string instr, int f, int s, int offset, string comment) {
-    if (instr == "sw" || instr == "lw") {
-        cout << instr << " $" << f << ", " << offset << "($" << s << ")";
-    } else if (instr == "bne" || instr == "beq") {
-        cout << instr << " $" << f << ", $" << s << ", " << offset;
+void readMerl(const string &path, MerlModule &m) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        string err = "ERROR: cannot read " + path;
+        throw err;
+    }
+    vector<unsigned int> words;
+    unsigned char word[4];
+    while (fread(word, 1, 4, f) == 4) {
+        words.push_back((word[0] << 24) | (word[1] << 16) | (word[2] << 8) | word[3]);
+    }
+    fclose(f);
+    m.name = path;
+    parseMerl(words, m);
+}
+
+vector<MerlModule> runtimeObjects;          // --link: linked after the program
+
+// Link the modules, each placed after the one before, into an image that
+// loads at address 0: relocations are applied and every import is bound
+// to the module exporting it.
+void linkImage(const vector<const MerlModule *> &modules, vector<unsigned int> &image) {
+    string err;
+    vector<unsigned int> base(modules.size());
+    unordered_map<string, unsigned int> exports;    // name → image address
+    unsigned int size = 0;
+    for (unsigned long i = 0; i < modules.size(); ++i) {
+        base[i] = size;
+        size += 4 * (unsigned int)modules[i]->code.size();
+        for (unsigned long k = 0; k < modules[i]->esd.size(); ++k) {
+            const pair<string, unsigned int> &e = modules[i]->esd[k];
+            if (!exports.insert(make_pair(e.first, e.second - merlHeader + base[i])).second) {
+                err = "ERROR: " + e.first + " is exported twice";
+                throw err;
+            }
+        }
+    }
+    image.clear();
+    image.reserve(size / 4);
+    for (unsigned long i = 0; i < modules.size(); ++i) {
+        const MerlModule &m = *modules[i];
+        unsigned long start = image.size();
+        image.insert(image.end(), m.code.begin(), m.code.end());
+        for (unsigned long k = 0; k < m.rel.size(); ++k) {
+            image[start + (m.rel[k] - merlHeader) / 4] += base[i] - merlHeader;
+        }
+        for (unsigned long k = 0; k < m.esr.size(); ++k) {
+            unordered_map<string, unsigned int>::const_iterator it = exports.find(m.esr[k].second);
+            if (it == exports.end()) {
+                err = "ERROR: " + m.esr[k].second + " is not defined by any object";
+                throw err;
+            }
+            image[start + (m.esr[k].first - merlHeader) / 4] = it->second;
+        }
     }
-    if (!comment.empty()) {
-        cout << "   ; " << comment;
+}
+
+// Local labels carry the procedure index so that procedures generated
+// apart never clash: while3x0 is the first loop of proc[3].
+int newLocalLabel(const char *prefix, int n) {
+    Emitter name;
+    name << prefix << gen->curProc << 'x' << n;
+    return gen->prog.newLabel(name.buf);
+}
+
+// Attribute the code that follows to a new statement of kind, nested in the
+// current while or if. Returns the source to restore afterwards.
+int enterSource(SourceKind kind) {
+    int outer = gen->curSource;
+    Source src;
+    src.proc = (int)gen->prog.procs.size() - 1;
+    src.kind = kind;
+    src.number = gen->countStatement++;
+    src.label = -1;
+    src.parent = -1;
+    if (outer != -1) {
+        const Source &o = gen->prog.sources[outer];
+        src.parent = (o.kind == SRC_WHILE || o.kind == SRC_IF ? outer : o.parent);
     }
-    cout << "\n";
+    gen->prog.sources.push_back(src);
+    gen->curSource = (int)gen->prog.sources.size() - 1;
+    return outer;
 }
 
-void typeI_label(string instr, int f, int s, string label, string comment) {
-    if (instr == "bne" || instr == "beq") {
-        cout << instr << " $" << f << ", $" << s << ", " << label;
+SourceKind statementKind(Node *statement) {
+    switch (statement->prod) {
+    case STATEMENT_ASSIGN:  return SRC_ASSIGN;
+    case STATEMENT_PRINTLN: return SRC_PRINTLN;
+    case STATEMENT_DELETE:  return SRC_DELETE;
+    case STATEMENT_WHILE:   return SRC_WHILE;
+    default:                return SRC_IF;
     }
-    if (!comment.empty()) {
-        cout << "   ; " << comment;
+}
+
+Instr makeInstr(Opcode op, int d, int s, int t, int imm, int label) {
+    Instr in;
+    in.op = (unsigned char)op;
+    in.d = (unsigned char)d;
+    in.s = (unsigned char)s;
+    in.t = (unsigned char)t;
+    in.imm = imm;
+    in.label = label;
+    in.source = -1;
+    return in;
+}
+
+void emit(Opcode op, int d, int s, int t, int imm, int label) {
+    gen->prog.code.push_back(makeInstr(op, d, s, t, imm, label));
+    gen->prog.code.back().source = gen->curSource;
+}
+
+void typeR(Opcode op, int d, int s, int t) {        // add, sub, slt, sltu
+    emit(op, d, s, t, 0, -1);
+}
+
+void typeMult(Opcode op, int s, int t) {            // mult, multu, div, divu
+    emit(op, 0, s, t, 0, -1);
+}
+
+void typeMove(Opcode op, int d) {                   // mfhi, mflo
+    emit(op, d, 0, 0, 0, -1);
+}
+
+void typeJump(Opcode op, int s) {                   // jr, jalr
+    emit(op, 0, s, 0, 0, -1);
+}
+
+void typeI_offset(Opcode op, int t, int s, int offset) {   // lw, sw
+    emit(op, 0, s, t, offset, -1);
+}
+
+void typeI_label(Opcode op, int s, int t, int label) {     // beq, bne
+    emit(op, 0, s, t, 0, label);
+}
+
+void lis(int d, int value) {
+    ++gen->lisConstants;
+    emit(OP_LIS, d, 0, 0, value, -1);
+}
+
+// Register that always holds value ($0, $11 = 1, $4 = 4), or -1.
+int constantRegister(int value) {
+    if (value == 0) return 0;
+    if (value == 1) return 11;
+    if (value == 4) return 4;
+    return -1;
+}
+
+void loadConstant(int d, int value) {
+    int r = constantRegister(value);
+    if (r != -1) {
+        typeR(OP_ADD, d, r, 0);
+    } else {
+        lis(d, value);
     }
-    cout << "\n";
 }
 
-void dotW_num(string i) {
-    cout << ".word " << i << endl;
+void lisLabel(int d, int label) {
+    emit(OP_LIS, d, 0, 0, 0, label);
 }
 
-void dotW(int i) {
-    cout << ".word " << i << endl;
+void placeLabel(int label) {
+    emit(OP_LABEL, 0, 0, 0, 0, label);
 }
 
 void push(int r) {
-    typeI_offset("sw", r, 30, -4, "push to stack, then decrement");
-    typeR("sub", 30, 30, 4);
+    ++gen->pushes;
+    typeI_offset(OP_SW, r, 30, -4);
+    typeR(OP_SUB, 30, 30, 4);
 }
 
 void pop(int r) {
-    typeI_offset("lw", r, 30, 0, "pop from stack, then increment");
-    typeR("add", 30, 30, 4);
+    ++gen->pops;
+    typeI_offset(OP_LW, r, 30, 0);
+    typeR(OP_ADD, 30, 30, 4);
 }
 
-void mipsTraversal(Node *tree) {
-    if (tree->lhs == "procedures") {
-        if (tree->rhs.size() == 1) {        // procedures → main
-            // procedures -> main
-            mipsTraversal(tree->children[0]);
-        } else {                            // procedures → procedure procedures
-            mipsTraversal(tree->children[1]);
-            curProc = tree->children[0]->children[1]->rhs[0];
-            mipsTraversal(tree->children[0]);
-        }
-    } else if (tree->lhs == "main") {
-        curProc = "wain";
-        cout << "; main function: " << endl;
-        init();
-        
-        typeI_offset("sw", 1, 29, -4, "");
-        typeI_offset("sw", 2, 29, -8, "");
-        typeR("sub", 30, 30, 4);
-        typeR("sub", 30, 30, 4);
-        cout << '\n';
-        
-        if (tree->children[3]->children[0]->rhs.size() == 1) {
-            typeR("add", 2, 0, 0);
-        }
-        push(31);
-        typeR("jalr", 16, -1, -1);
-        pop(31);
-        
-        mipsTraversal(tree->children[3]);
-        mipsTraversal(tree->children[5]);
-        mipsTraversal(tree->children[8]);
-        mipsTraversal(tree->children[9]);
-        mipsTraversal(tree->children[11]);
-        cout << "\n; Return to OS" << endl;
-        typeR("add", 30, 30, 4);
-        typeR("add", 30, 30, 4);
-        //        typeI_offset("lw", 1, 29, -4, "");
-        //        typeI_offset("lw", 2, 29, -8, "");
-        cout << "jr $31" << endl;
-        
-    } else if (tree->lhs == "procedure") {
-        cout << '\n' << "f" << tree->children[1]->rhs[0] << ":" << endl;
-        curProc = tree->children[1]->rhs[0];
-        
-        //        push(29);
-        //	typeR("sub", 29, 30, 0);
-        framePtr = -4;
-        
-        mipsTraversal(tree->children[3]);
-        mipsTraversal(tree->children[6]);
-        mipsTraversal(tree->children[7]);
-        mipsTraversal(tree->children[9]);
-        
-        typeR("add", 30, 29, 0);
-        //      pop(29);
-        typeR("jr", 31, -1, -1);
-        
-    } else if (tree->lhs == "dcls") {
-        if (tree->rhs.size() == 0) {    // dcls →
-            // do nothing
-        } else if (tree->rhs[3] == "NUM") { // dcls → dcls dcl BECOMES NUM SEMI
-            mipsTraversal(tree->children[0]);
-            mipsTraversal(tree->children[1]);
-            typeR("lis", 3, -1, -1);
-            dotW_num(tree->children[3]->rhs[0]);
-            string curID = tree->children[1]->children[1]->rhs[0];
-            typeI_offset("sw", 3, 29, mipsMap[curProc][curID].second, "");
-            typeR("sub", 30, 30, 4);
-            cout << '\n';
-        } else {          // dcls → dcls dcl BECOMES NULL SEMI
-            mipsTraversal(tree->children[0]);
-            mipsTraversal(tree->children[1]);
-            typeR("lis", 3, -1, -1);
-            dotW_num("1");
-            string curID = tree->children[1]->children[1]->rhs[0];
-            typeI_offset("sw", 3, 29, mipsMap[curProc][curID].second, "");
-            typeR("sub", 30, 30, 4);
-            cout << '\n';
-        }
-    } else if (tree->lhs == "dcl") {    // dcl → type ID
-        pair<string, int> curVar;
-        curVar.second = framePtr;
-        
-        if (tree->children[0]->rhs.size() == 1) {    // type → INT
-            curVar.first = "int";
-        } else {                        // type → INT STAR
-            curVar.first = "int*";
-        }
-        
-        framePtr -= 4;
-      
-        symTbl[tree->children[1]->rhs[0]] = curVar;
-        mipsMap[curProc] = symTbl;
-        
-    } else if (tree->lhs == "statements") {
-        if (tree->rhs.size() == 0) {    // statements →
-            // do nothing
-        } else if (tree->rhs.size() == 2) {
-            // statements → statements statement
-            mipsTraversal(tree->children[0]);
-            mipsTraversal(tree->children[1]);
-        }
-    } else if (tree->lhs == "statement") {
-        if (tree->rhs.size() == 4) {
-            // statement → lvalue BECOMES expr SEMI
-            if (tree->children[0]->rhs.size() == 1) {   // lvalue == ID
-                mipsTraversal(tree->children[0]);
-                push(3);
-                mipsTraversal(tree->children[2]);
-                pop(5);
-                typeI_offset("sw", 3, 5, 0, "initialize lvalue");
-            } else {
-                mipsTraversal(tree->children[0]->children[1]);  // code(factor)
-                push(3);
-                mipsTraversal(tree->children[2]);
-                pop(5);
-		typeI_offset("sw", 3, 5, 0, "");
-            }
-            
-        } else if (tree->rhs.size() == 5 && tree->rhs[0] == "PRINTLN") {
-            // statement → PRINTLN LPAREN expr RPAREN SEMI
-            mipsTraversal(tree->children[2]);
-            typeR("add", 1, 3, 0);
-            cout << "; Call print" << endl;
-            push(31);
-            typeR("jalr", 15, -1, -1);      // print is initilized in $15
-            pop(31);
-            cout << '\n';
-        } else if (tree->rhs.size() == 5 && tree->rhs[0] == "DELETE") {
-            // statement → DELETE LBRACK RBRACK expr SEMI
-            mipsTraversal(tree->children[3]);
-            typeI_offset("beq", 3, 11, 6, "");
-            typeR("add", 1, 3, 0);
-            push(31);
-            typeR("jalr", 18, -1, -1);
-            pop(31);
-        } else if (tree->rhs.size() == 7) {
-            // statement → WHILE LPAREN test RPAREN LBRACE statements RBRACK
-            stringstream ss;
-            ss << countWhile;
-            string begin = "while" + ss.str();
-            string end = "endWhile" + ss.str();
-            countWhile++;
-            
-            cout << begin << ":" << endl;
-            mipsTraversal(tree->children[2]);
-            cout << end << endl;
-            
-            mipsTraversal(tree->children[5]);
-            typeI_label("beq", 0, 0, begin, "");
-            cout << end << ":" << endl;
-            
-        } else {            // if statement
-            stringstream ss;
-            ss << countIf;
-            string begin = "if" + ss.str();
-            string elseloop = "else" + ss.str();
-            string end = "endif" + ss.str();
-            countIf++;
-            
-            mipsTraversal(tree->children[2]);
-            cout << elseloop << endl;
-            mipsTraversal(tree->children[5]);
-            typeI_label("beq", 0, 0, end, "");
-            cout << elseloop << ":" << endl;
-            mipsTraversal(tree->children[9]);
-            cout << end << ":" << endl;
-        }
-        
-    } else if (tree->lhs == "lvalue") {
-        if (tree->rhs.size() == 1) {        // lvalue → ID
-            typeR("lis", 3, -1, -1);
-            string curID = tree->children[0]->rhs[0];
-            int curOff = mipsMap[curProc][curID].second;
-            stringstream ss;
-            ss << curOff;
-            dotW_num(ss.str());
-            cout << "\n; Address of current ID" << endl;
-            typeR("add", 3, 3, 29);
-            
-        } else if (tree->rhs.size() == 2) { // lvalue → STAR factor
-            mipsTraversal(tree->children[1]);
-        } else {                            // lvalue → LPAREN lvalue RPAREN
-            mipsTraversal(tree->children[1]);
-        }
-    } else if (tree->lhs == "expr") {
-        if (tree->rhs.size() == 1) {        // expr → term
-            mipsTraversal(tree->children[0]);
-        } else if (tree->rhs[1] == "PLUS") {    // expr → expr PLUS term
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            
-            if (expr(tree->children[0]) == "int" &&
-                term(tree->children[2]) == "int") {
-                
-                typeR("add", 3, 5, 3);
-            } else if (expr(tree->children[0]) == "int*" &&
-                       term(tree->children[2]) == "int") {
-                typeR("mult", 3, 4, -1);
-                typeR("mflo", 3, -1, -1);
-                typeR("add", 3, 5, 3);
-            } else {
-                typeR("mult", 5, 4, -1);
-                typeR("mflo", 5, -1, -1);
-                typeR("add", 3, 3, 5);
-            }
-            
-        } else if (tree->rhs[1] == "MINUS") {   // expr → expr MINUS term
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            
-            if (expr(tree->children[0]) == "int" &&
-                term(tree->children[2]) == "int"){
-                typeR("sub", 3, 5, 3);
-            } else if (expr(tree->children[0]) == "int*" &&
-                       term(tree->children[2]) == "int"){
-                typeR("mult", 3, 4, -1);
-                typeR("mflo", 3, -1, -1);
-                typeR("sub", 3, 5, 3);
-            } else {
-                typeR("sub", 3, 5, 3);
-                typeR("div", 3, 4, -1);
-                typeR("mflo", 3, -1, -1);
-            }
-            
-        }
-    } else if (tree->lhs == "term") {
-        if (tree->rhs.size() == 1) {            // term → factor
-            return mipsTraversal(tree->children[0]);
-        } else if (tree->rhs[1] == "STAR") {    // term → term STAR factor
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            cout << "\n; multiplication" << endl;
-            typeR("mult", 3, 5, -1);
-            typeR("mflo", 3, -1, -1);
-        } else if (tree->rhs[1] == "SLASH") {    // term → term SLASH factor
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            cout << "\n; division" << endl;
-            typeR("div", 5, 3, -1);
-            typeR("mflo", 3, -1, -1);
-        } else if (tree->rhs[1] == "PCT") {    // term → term PCT factor
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            cout << "\n; modulo" << endl;
-            typeR("div", 5, 3, -1);
-            typeR("mfhi", 3, -1, -1);
-        }
-        
-    } else if (tree->lhs == "factor") {
-        if (tree->rhs.size() == 1 && tree->rhs[0] == "ID") {
-            // factor → ID
-            int curOffset = mipsMap[curProc][tree->children[0]->rhs[0]].second;
-            typeI_offset("lw", 3, 29, curOffset, "Load ID");
-        } else if (tree->rhs.size() == 1 && tree->rhs[0] == "NUM") {
-            // factor → NUM
-            typeR("lis", 3, -1, -1);
-            dotW_num(tree->children[0]->rhs[0]);
-        } else if (tree->rhs.size() == 1 && tree->rhs[0] == "NULL") {
-            // factor → NULL
-            typeR("add", 3, 11, 0);
-        } else if (tree->rhs.size() == 2 && tree->rhs[0] == "AMP") {
-            // factor → AMP lvalue
-            int offset;
-            if (tree->children[1]->rhs.size() == 1) {
-                offset = mipsMap[curProc][tree->children[1]->children[0]->rhs[0]].second;
-                typeR("lis", 3, -1, -1);
-                dotW(offset);
-                typeR("add", 3, 29, 3);
-            } else if (tree->children[1]->rhs.size() == 2) {
-                mipsTraversal(tree->children[1]->children[1]);
-            } else {
-                string id = lvalueStr(tree->children[1]);
-                offset = mipsMap[curProc][id].second;
-                typeR("lis", 3, -1, -1);
-                dotW(offset);
-                typeR("add", 3, 29, 3);
-            }
-        } else if (tree->rhs.size() == 2 && tree->rhs[0] == "STAR") {
-            // factor → STAR factor
-            mipsTraversal(tree->children[1]);
-            typeI_offset("lw", 3, 3, 0, "");
-        } else if (tree->rhs.size() == 3 && tree->rhs[0] == "LPAREN") {
-            // factor → LPAREN expr RPAREN
-            mipsTraversal(tree->children[1]);
-        } else if (tree->rhs.size() == 3 && tree->rhs[0] == "ID") {
-            // factor → ID LPAREN RPAREN
-            framePtr = -4;
-            string id = "f" + tree->children[0]->rhs[0];
-            
-            typeR("lis", 8, -1, -1);
-            dotW_num(id);
-            push(29);
-            push(31);
-            typeR("add", 29, 30, 0);
-            typeR("jalr", 8, -1, -1);
-            pop(31);
-            pop(29);
-            
-        } else if (tree->rhs.size() == 4) {
-            // factor → ID LPAREN arglist RPAREN
-            framePtr = -4;
-            string id = "f" + tree->children[0]->rhs[0];
-            
-            typeR("lis", 8, -1, -1);
-            dotW_num(id);
-            
-            push(29);
-            push(31);
-            typeR("add", 28, 30, 0);
-            mipsTraversal(tree->children[2]);
-            typeR("add", 29, 28, 0);
-            typeR("jalr", 8, -1, -1);
-            
-            pop(31);
-            pop(29);
-        } else if (tree->rhs.size() == 5) {
-            // factor → NEW INT LBRACK expr RBRACK
-            mipsTraversal(tree->children[3]);
-            typeR("add", 1, 3, 0);
-            push(31);
-            typeR("jalr", 17, -1, -1);
-            pop(31);
-            typeI_offset("bne", 3, 0, 1, "");
-            typeR("add", 3, 11, 0);	// new is failed
-        }
-    } else if (tree->lhs == "params") {
-        if (tree->rhs.size() == 0) {
-            // params →, do nothing
-        } else {
-            // params → paramlist
-            mipsTraversal(tree->children[0]);
-        }
-        
-    } else if (tree->lhs == "paramlist") {
-        if (tree->rhs.size() == 1) {
-            // paramlist → dcl
-            mipsTraversal(tree->children[0]);
-        } else {
-            // paramlist → dcl COMMA paramlist
-            mipsTraversal(tree->children[0]);
-            mipsTraversal(tree->children[2]);
-        }
-        
-    } else if (tree->lhs == "arglist") {
-        if (tree->rhs.size() == 1) {
-            // arglist → expr
-            mipsTraversal(tree->children[0]);
-            typeI_offset("sw", 3, 28, framePtr, "");
-            typeR("sub", 30, 30, 4);
-            framePtr -= 4;
-        } else {
-            // arglist → expr COMMA arglist
-            mipsTraversal(tree->children[0]);
-            typeI_offset("sw", 3, 28, framePtr, "");
-            typeR("sub", 30, 30, 4);
-            framePtr -= 4;
-            mipsTraversal(tree->children[2]);
-            
-        }
-    } else if (tree->lhs == "test") {   // test → expr XX expr
-        if (tree->rhs[1] == "EQ") {
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            
-            cout << "bne $3, $5, ";
-        } else if (tree->rhs[1] == "NE") {
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            
-            cout << "beq $3, $5, ";
-        } else if (tree->rhs[1] == "LT") {
-            string type = expr(tree->children[0]);
-            string cmd = (type == "int" ? "slt" : "sltu");
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            
-            typeR(cmd, 3, 5, 3);
-            cout << "bne $3, $11, ";
-        } else if (tree->rhs[1] == "LE") {
-            string type = expr(tree->children[0]);
-            string cmd = (type == "int" ? "slt" : "sltu");
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            
-            typeR(cmd, 3, 3, 5);
-            cout << "bne $3, $0, ";
-            
-        } else if (tree->rhs[1] == "GE") {
-            string type = expr(tree->children[0]);
-            string cmd = (type == "int" ? "slt" : "sltu");
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            
-            typeR(cmd, 6, 5, 3);
-            cout << "bne $6, $0, ";
-            
-        } else if (tree->rhs[1] == "GT") {
-            string type = expr(tree->children[0]);
-            string cmd = (type == "int" ? "slt" : "sltu");
-            mipsTraversal(tree->children[0]);
-            push(3);
-            mipsTraversal(tree->children[2]);
-            pop(5);
-            
-            typeR(cmd, 6, 3, 5);
-            cout << "bne $6, $11, ";
-            
-        }
+// $30 += bytes in one step; scratch may be needed to hold the amount.
+void adjustStack(int bytes, int scratch) {
+    if (bytes == 0) return;
+    Opcode op = (bytes > 0 ? OP_ADD : OP_SUB);
+    if (bytes == 4 || bytes == -4) {
+        typeR(op, 30, 30, 4);
+    } else {
+        lis(scratch, bytes > 0 ? bytes : -bytes);
+        typeR(op, 30, 30, scratch);
     }
-    
 }
 
-int main(int argc, const char * argv[]) {
-    Node *parseTree = buildTree(std::cin);
-    Procedure wain;
-    
-    try {
-        buildSymbolTable(parseTree);
-        // printSymbolTable();
-        mipsTraversal(parseTree->children[1]);
-    } catch (string err) { cerr << err << endl; }
-    return 0;
+// Label of the entry point of procedure p, created on first use.
+int procLabel(int p) {
+    unordered_map<int, int>::const_iterator it = gen->procLabels.find(p);
+    if (it != gen->procLabels.end()) return it->second;
+    int label = gen->prog.newLabel("f" + unit->proc[p].procName);
+    gen->procLabels[p] = label;
+    return label;
 }
 
+Symbol &symbol(Node *id) {
+    Procedure &p = unit->proc[gen->curProc];
+    return p.symbols[findSymbol(p, id)];
+}
+
+void init() {
+    static const char *const runtime[] = { "print", "init", "new", "delete" };
+    
+    lis(4, 4);
+    for (int i = 0; i < 4; ++i) {           // $15 print, $16 init, $17 new, $18 delete
+        int label = gen->prog.newLabel(runtime[i]);
+        gen->prog.imports.push_back(label);
+        lisLabel(15 + i, label);
+    }
+    lis(11, 1);
+    typeR(OP_ADD, 29, 30, 0);
+}
+
+void mipsTraversal(Node *tree);
+void genValue(Node *tree, int dst, int depth);
+
+// Registers for expression temporaries. None of them is touched by print or
+// alloc, and the last one is kept free for reloading spilled operands. A
+// leaf procedure keeps its variables in the top ones and uses the rest.
+const int pool[] = { 5, 6, 7, 8, 9, 10, 12, 13, 14, 19 };
+const int poolSize = sizeof(pool) / sizeof(pool[0]);
+const int minTemps = 4;                 // pool registers a leaf leaves to expressions
+
+// Registers for the variables of a procedure that calls out. It saves the
+// ones it takes on entry and restores them on return, so they survive the
+// calls it makes. print and alloc leave them alone too.
+const int savedRegs[] = { 20, 21, 22, 23, 24, 25, 26, 27 };
+const int numSavedRegs = sizeof(savedRegs) / sizeof(savedRegs[0]);
+
+// The first arguments of a call are passed in these; the rest are stored
+// in the callee's frame, just below $30. None of them is in the pool.
+const int argRegs[] = { 1, 2, 3, 28 };
+const int numArgRegs = sizeof(argRegs) / sizeof(argRegs[0]);
+
+// Register of the variable that expr or lvalue tree is, or -1 when it is
+// not a variable kept in a register.
+int varRegister(Node *tree) {
+    for (;;) {
+        switch (tree->prod) {
+        case EXPR_TERM:
+        case TERM_FACTOR:
+            tree = tree->child(0);
+            continue;
+        case FACTOR_PAREN:
+        case LVALUE_PAREN:
+            tree = tree->child(1);
+            continue;
+        case FACTOR_ID:
+        case LVALUE_ID:
+            return gen->varRegs[findSymbol(unit->proc[gen->curProc], tree->child(0))];
+        default:
+            return -1;
+        }
+    }
+}
+
+// The factor that expr tree comes down to through single-child chains and
+// parentheses.
+Node *innerFactor(Node *tree) {
+    for (;;) {
+        switch (tree->prod) {
+        case EXPR_TERM:
+        case TERM_FACTOR:
+            tree = tree->child(0);
+            continue;
+        case FACTOR_PAREN:
+            tree = tree->child(1);
+            continue;
+        default:
+            return tree;
+        }
+    }
+}
+
+// Register that already holds the value of tree, or -1: a variable kept
+// in a register, or a constant held in $0, $11 or $4.
+int operandRegister(Node *tree) {
+    int value;
+    if (constantOf(tree, value)) return constantRegister(value);
+    if (innerFactor(tree)->prod == FACTOR_NULL) return 11;
+    return varRegister(tree);
+}
+
+// Whether tree is a known number or NULL, the same whenever evaluated.
+bool isConstant(Node *tree) {
+    int value;
+    return constantOf(tree, value) || innerFactor(tree)->prod == FACTOR_NULL;
+}
+
+// Evaluate l and r into registers; a and b receive where each ended up.
+// dst and pool[depth..] may be used. The operand that needs more registers
+// goes first. When the other one makes a call or the pool is full, l goes
+// onto the stack, unless r is a leaf that can wait in a register or l a
+// constant that can be loaded afterwards. A variable or constant already
+// in a register is used from there and never written.
+void genPair(Node *l, Node *r, int dst, int depth, int &a, int &b) {
+    a = operandRegister(l);
+    b = operandRegister(r);
+    if (a != -1 && b != -1) return;
+    if (a != -1) {
+        genValue(r, dst, depth);
+        b = dst;
+        return;
+    }
+    if (b != -1) {
+        genValue(l, dst, depth);
+        a = dst;
+        return;
+    }
+    if (l->regs != 0 && r->regs != 0 && depth + 1 < gen->temps) {
+        int spare = pool[depth];
+        if (l->regs >= r->regs) {
+            genValue(l, dst, depth);
+            genValue(r, spare, depth + 1);
+            a = dst;
+            b = spare;
+        } else {
+            genValue(r, dst, depth);
+            genValue(l, spare, depth + 1);
+            a = spare;
+            b = dst;
+        }
+    } else if (isConstant(r) || innerFactor(r)->prod == FACTOR_ID) {
+        genValue(l, dst, depth);
+        genValue(r, pool[depth], depth + 1);
+        a = dst;
+        b = pool[depth];
+    } else if (isConstant(l)) {
+        genValue(r, dst, depth);
+        genValue(l, pool[depth], depth + 1);
+        a = pool[depth];
+        b = dst;
+    } else {
+        genValue(l, dst, depth);
+        push(dst);
+        genValue(r, dst, depth);
+        pop(pool[depth]);
+        a = pool[depth];
+        b = dst;
+    }
+}
+
+// The operand that tree evaluates to when the other one is a neutral
+// constant (x+0, 0+x, x-0, x*1, 1*x, x/1), or NULL.
+Node *identityOperand(Node *tree) {
+    int l = -1, r = -1;
+    bool lc = constantOf(tree->child(0), l);
+    bool rc = constantOf(tree->child(2), r);
+    switch (tree->prod) {
+    case EXPR_PLUS:
+        if (rc && r == 0) return tree->child(0);
+        if (lc && l == 0) return tree->child(2);
+        break;
+    case EXPR_MINUS:
+        if (rc && r == 0) return tree->child(0);
+        break;
+    case TERM_STAR:
+        if (rc && r == 1) return tree->child(0);
+        if (lc && l == 1) return tree->child(2);
+        break;
+    case TERM_SLASH:
+        if (rc && r == 1) return tree->child(0);
+        break;
+    default:
+        break;
+    }
+    return NULL;
+}
+
+const int maxAddChain = 5;              // longest add sequence replacing a mult
+
+void scaleBy4(int r) {
+    typeR(OP_ADD, r, r, r);
+    typeR(OP_ADD, r, r, r);
+}
+
+// Instructions multiplyBy needs for c, or INT_MAX when mult must be used.
+int addChainCost(int c) {
+    if (c == 0 || c == INT_MIN) return INT_MAX;
+    unsigned int u = (c < 0 ? 0u - (unsigned int)c : (unsigned int)c);
+    int doublings = 0, adds = 0;
+    for (; u > 1; u >>= 1) {
+        ++doublings;
+        adds += (int)(u & 1);
+    }
+    return doublings + adds + (adds > 0 ? 1 : 0) + (c < 0 ? 1 : 0);
+}
+
+// $r = $r * c by doubling and adding, scanning c from its top bit down.
+// scratch keeps the original value when c is not a power of two.
+void multiplyBy(int r, int c, int scratch) {
+    unsigned int u = (c < 0 ? 0u - (unsigned int)c : (unsigned int)c);
+    int top = 31;
+    while (((u >> top) & 1) == 0) --top;
+    if ((u & (u - 1)) != 0) typeR(OP_ADD, scratch, r, 0);
+    for (int bit = top - 1; bit >= 0; --bit) {
+        typeR(OP_ADD, r, r, r);
+        if ((u >> bit) & 1) typeR(OP_ADD, r, r, scratch);
+    }
+    if (c < 0) typeR(OP_SUB, r, 0, r);
+}
+
+// Cheaper code for a binary node with one constant operand: a multiply
+// becomes an add chain, pointer offsets are scaled at compile time, and
+// adding 1 or 4 uses the register holding it. Division stays on div since
+// this instruction set has no shifts to correct a signed quotient with.
+bool reduceStrength(Node *tree, int dst, int depth) {
+    Node *l = tree->child(0), *r = tree->child(2);
+    int c, reg;
+    switch (tree->prod) {
+    case TERM_STAR: {
+        Node *x;
+        if (constantOf(r, c)) {
+            x = l;
+        } else if (constantOf(l, c)) {
+            x = r;
+        } else {
+            return false;
+        }
+        if (addChainCost(c) > maxAddChain) return false;
+        genValue(x, dst, depth);
+        multiplyBy(dst, c, pool[depth]);
+        return true;
+    }
+    case EXPR_PLUS:
+    case EXPR_MINUS: {
+        Node *x;
+        if (constantOf(r, c)) {
+            x = l;
+        } else if (tree->prod == EXPR_PLUS && constantOf(l, c)) {
+            x = r;
+        } else {
+            return false;
+        }
+        if (x->type == PTR_TYPE) c = (int)((unsigned int)c * 4u);
+        reg = constantRegister(c);
+        if (reg == -1 && x->type == INT_TYPE) return false;
+        int src = varRegister(x);
+        if (src == -1) {
+            genValue(x, dst, depth);
+            src = dst;
+        }
+        if (reg == -1) {
+            reg = pool[depth];
+            lis(reg, c);
+        }
+        typeR(tree->prod == EXPR_PLUS ? OP_ADD : OP_SUB, dst, src, reg);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Whether r holds a variable or a constant and must not be written: a
+// saved register, a pool register past the temporaries, $0, $11 or $4.
+bool isReadOnly(int r) {
+    if (r == 0 || r == 11 || r == 4) return true;
+    for (int i = 0; i < numSavedRegs; ++i) {
+        if (savedRegs[i] == r) return true;
+    }
+    for (int i = gen->temps; i < poolSize; ++i) {
+        if (pool[i] == r) return true;
+    }
+    return false;
+}
+
+// Register holding r * 4. A variable's or constant's register is left
+// alone and the product goes to scratch instead.
+int scaled(int r, int scratch) {
+    if (isReadOnly(r)) {
+        typeR(OP_ADD, scratch, r, r);
+        r = scratch;
+        typeR(OP_ADD, r, r, r);
+    } else {
+        scaleBy4(r);
+    }
+    return r;
+}
+
+// dst = a op b for the binary expr or term node tree; scratch is free.
+void combine(Node *tree, int dst, int a, int b, int scratch) {
+    Type left = (Type)tree->child(0)->type;
+    Type right = (Type)tree->child(2)->type;
+    switch (tree->prod) {
+    case EXPR_PLUS:
+        if (left == PTR_TYPE && right == INT_TYPE) {
+            b = scaled(b, scratch);
+        } else if (left == INT_TYPE && right == PTR_TYPE) {
+            a = scaled(a, scratch);
+        }
+        typeR(OP_ADD, dst, a, b);
+        break;
+    case EXPR_MINUS:
+        if (left == PTR_TYPE && right == INT_TYPE) {
+            b = scaled(b, scratch);
+        }
+        typeR(OP_SUB, dst, a, b);
+        if (left == PTR_TYPE && right == PTR_TYPE) {
+            typeMult(OP_DIV, dst, 4);
+            typeMove(OP_MFLO, dst);
+        }
+        break;
+    case TERM_STAR:
+        typeMult(OP_MULT, a, b);
+        typeMove(OP_MFLO, dst);
+        break;
+    case TERM_SLASH:
+    case TERM_PCT:
+        typeMult(OP_DIV, a, b);
+        typeMove(tree->prod == TERM_SLASH ? OP_MFLO : OP_MFHI, dst);
+        break;
+    default:
+        break;
+    }
+}
+
+const int maxOffset = 32767;            // lw and sw offsets are 16 bits
+
+void lvalueAddress(Node *tree, int dst, int depth, int &base, int &offset);
+
+// Make base + offset a register, dst unless it is offset 0 from base.
+void settleAddress(int dst, int depth, int &base, int &offset) {
+    if (offset == 0) return;
+    if (offset == 4 || offset == -4) {
+        typeR(offset > 0 ? OP_ADD : OP_SUB, dst, base, 4);
+    } else if (base != dst) {
+        lis(dst, offset);
+        typeR(OP_ADD, dst, dst, base);
+    } else {
+        lis(pool[depth], offset);
+        typeR(OP_ADD, dst, dst, pool[depth]);
+    }
+    base = dst;
+    offset = 0;
+}
+
+// The address pointer expression tree evaluates to, as base register and
+// offset. &lvalue and constant steps fold into the offset, a variable in
+// a register is used in place, and anything else is evaluated into dst.
+void pointerAddress(Node *tree, int dst, int depth, int &base, int &offset) {
+    int c;
+    for (;;) {
+        switch (tree->prod) {
+        case EXPR_TERM:
+        case TERM_FACTOR:
+            tree = tree->child(0);
+            continue;
+        case FACTOR_PAREN:
+            tree = tree->child(1);
+            continue;
+        case FACTOR_AMP:
+            lvalueAddress(tree->child(1), dst, depth, base, offset);
+            return;
+        case EXPR_PLUS:
+        case EXPR_MINUS: {
+            Node *l = tree->child(0), *r = tree->child(2);
+            Node *ptr = NULL;
+            if (l->type == PTR_TYPE && constantOf(r, c)) {
+                ptr = l;
+            } else if (tree->prod == EXPR_PLUS && r->type == PTR_TYPE && constantOf(l, c)) {
+                ptr = r;
+            }
+            if (ptr == NULL || c < -maxOffset / 4 || c > maxOffset / 4) break;
+            pointerAddress(ptr, dst, depth, base, offset);
+            int step = (tree->prod == EXPR_PLUS ? 4 * c : -4 * c);
+            if (offset + step < -maxOffset || offset + step > maxOffset) {
+                settleAddress(dst, depth, base, offset);
+            }
+            offset += step;
+            return;
+        }
+        default:
+            break;
+        }
+        break;
+    }
+    offset = 0;
+    base = varRegister(tree);
+    if (base == -1) {
+        genValue(tree, dst, depth);
+        base = dst;
+    }
+}
+
+// The address lvalue tree names, as base register and offset.
+void lvalueAddress(Node *tree, int dst, int depth, int &base, int &offset) {
+    while (tree->prod == LVALUE_PAREN) tree = tree->child(1);
+    if (tree->prod == LVALUE_ID) {
+        base = gen->frameReg;
+        offset = symbol(tree->child(0)).offset;
+    } else {                                // lvalue → STAR factor
+        pointerAddress(tree->child(1), dst, depth, base, offset);
+    }
+}
+
+// Whether evaluating tree may read memory or call: a variable in the
+// frame, a dereference, a call or new.
+bool readsMemory(Node *tree) {
+    switch (tree->prod) {
+    case FACTOR_ID:
+        return varRegister(tree) == -1;
+    case FACTOR_STAR:
+    case FACTOR_CALL:
+    case FACTOR_CALL_ARGS:
+    case FACTOR_NEW:
+        return true;
+    default:
+        break;
+    }
+    for (unsigned long i = 0; i < tree->numChildren(); ++i) {
+        if (readsMemory(tree->child(i))) return true;
+    }
+    return false;
+}
+
+// Call a procedure, leaving its result in $3. The callee keeps $29 and $30,
+// so the caller saves nothing and the stack is adjusted at most once.
+void genCall(Node *tree) {
+    vector<Node *> args;
+    if (tree->prod == FACTOR_CALL_ARGS) {
+        for (Node *list = tree->child(2); ; list = list->child(2)) {
+            args.push_back(list->child(0));
+            if (list->prod == ARGLIST_EXPR) break;
+        }
+    }
+    int n = (int)args.size();
+    bool direct = true;                     // no argument touches the stack
+    for (int i = 0; i < n; ++i) {
+        if (args[i]->regs == 0 || args[i]->regs >= gen->temps - 1) direct = false;
+    }
+    
+    if (direct) {
+        for (int i = numArgRegs; i < n; ++i) {
+            genValue(args[i], 3, 0);
+            typeI_offset(OP_SW, 3, 30, -4 * (i + 1));
+        }
+        for (int i = 0; i < n && i < numArgRegs; ++i) {
+            genValue(args[i], argRegs[i], 0);
+        }
+    } else {
+        // Reserve the argument slots first: calls and spills while
+        // evaluating the arguments then stay below them.
+        adjustStack(-4 * n, 8);
+        for (int i = 0; i < n; ++i) {
+            genValue(args[i], 3, 0);
+            typeI_offset(OP_SW, 3, 30, 4 * (n - 1 - i));
+        }
+        for (int i = 0; i < n && i < numArgRegs; ++i) {
+            typeI_offset(OP_LW, argRegs[i], 30, 4 * (n - 1 - i));
+        }
+        adjustStack(4 * n, 8);
+    }
+    lisLabel(8, procLabel(findProc(tree->child(0))));
+    typeJump(OP_JALR, 8);
+}
+
+// Whether an expression under tree may need more registers than there are
+// temporaries, and so spill onto the stack.
+bool maySpill(Node *tree) {
+    if (tree->regs >= gen->temps - 1) return true;
+    for (unsigned long i = 0; i < tree->numChildren(); ++i) {
+        if (maySpill(tree->child(i))) return true;
+    }
+    return false;
+}
+
+// Bytes of the frame below the frame pointer.
+int frameBytes(const Procedure &p) {
+    return 4 * (int)p.symbols.size() + (p.leaf ? 0 : 8);
+}
+
+const long loopWeight = 8;              // uses in a loop count this many times more
+
+// Add the uses of each variable under tree to uses, weighted by loop
+// depth. A variable whose address is taken is marked -1.
+void countUses(Node *tree, const Procedure &p, vector<long> &uses, long weight) {
+    switch (tree->prod) {
+    case FACTOR_AMP: {                      // factor → AMP lvalue
+        Node *lvalue = tree->child(1);
+        while (lvalue->prod == LVALUE_PAREN) lvalue = lvalue->child(1);
+        if (lvalue->prod == LVALUE_ID) {
+            uses[findSymbol(p, lvalue->child(0))] = -1;
+            return;
+        }
+        break;
+    }
+    case FACTOR_ID:
+    case LVALUE_ID: {
+        long &n = uses[findSymbol(p, tree->child(0))];
+        if (n != -1) n += weight;
+        return;
+    }
+    case STATEMENT_WHILE:
+        if (weight < LONG_MAX / loopWeight) weight *= loopWeight;
+        break;
+    default:
+        break;
+    }
+    for (unsigned long i = 0; i < tree->numChildren(); ++i) {
+        countUses(tree->child(i), p, uses, weight);
+    }
+}
+
+// Keep the most used variables of procedure tree whose address is never
+// taken in registers. A procedure that calls out has savedRegs for them,
+// except for parameters passed in its frame; a leaf takes the top of the
+// pool and is left fewer temporaries.
+void assignRegisters(Node *tree, const Procedure &p) {
+    vector<long> uses(p.symbols.size(), 0);
+    countUses(tree, p, uses, 1);
+    vector<pair<long, int> > order;
+    for (int i = 0; i < (int)uses.size(); ++i) {
+        if (uses[i] <= 0) continue;
+        if (!p.leaf && i < (int)p.params.size() && i >= numArgRegs) continue;
+        order.push_back(make_pair(uses[i], -i));
+    }
+    std::sort(order.rbegin(), order.rend());        // most used first, then in order
+    
+    int regs = (p.leaf ? poolSize - minTemps : numSavedRegs);
+    if ((int)order.size() < regs) regs = (int)order.size();
+    gen->varRegs.assign(p.symbols.size(), -1);
+    for (int k = 0; k < regs; ++k) {
+        gen->varRegs[-order[k].second] = (p.leaf ? pool[poolSize - 1 - k] : savedRegs[k]);
+    }
+    gen->temps = (p.leaf ? poolSize - regs : poolSize);
+}
+
+// Move the parameters from argRegs and the slots below base to where they
+// live. With save, the caller's value of each register taken by a variable
+// is kept in that variable's slot first.
+void enterVariables(const Procedure &p, int base, bool save) {
+    int n = (int)p.params.size();
+    for (int i = 0; i < (int)p.symbols.size(); ++i) {
+        int r = gen->varRegs[i], offset = p.symbols[i].offset;
+        if (r != -1 && save) typeI_offset(OP_SW, r, base, offset);
+        if (i >= n) continue;
+        if (i >= numArgRegs) {
+            if (r != -1) typeI_offset(OP_LW, r, base, offset);
+        } else if (r != -1) {
+            typeR(OP_ADD, r, argRegs[i], 0);
+        } else {
+            typeI_offset(OP_SW, argRegs[i], base, offset);
+        }
+    }
+}
+
+// Restore the registers saved by enterVariables.
+void leaveVariables(const Procedure &p) {
+    for (int i = 0; i < (int)p.symbols.size(); ++i) {
+        if (gen->varRegs[i] != -1) typeI_offset(OP_LW, gen->varRegs[i], 29, p.symbols[i].offset);
+    }
+}
+
+int defOf(const Instr &in);
+
+// Move the value just computed into from to register to, by making the
+// instruction that computed it write to instead when it can.
+void moveResult(int from, int to) {
+    vector<Instr> &code = gen->prog.code;
+    if (!code.empty() && defOf(code.back()) == from) {
+        if (code.back().op == OP_LW) {
+            code.back().t = to;
+        } else {
+            code.back().d = to;
+        }
+    } else {
+        typeR(OP_ADD, to, from, 0);
+    }
+}
+
+// Evaluate an expr, term, factor or lvalue into register dst; an lvalue
+// yields its address. Calls only happen with depth 0, when no temporaries
+// are live in registers.
+void genValue(Node *tree, int dst, int depth) {
+    int a, b, value;
+    if (constantOf(tree, value)) {
+        loadConstant(dst, value);
+        return;
+    }
+    switch (tree->prod) {
+    case EXPR_TERM:                         // expr → term
+    case TERM_FACTOR:                       // term → factor
+        genValue(tree->child(0), dst, depth);
+        break;
+    case EXPR_PLUS:                         // expr → expr PLUS term
+    case EXPR_MINUS:                        // expr → expr MINUS term
+    case TERM_STAR:                         // term → term STAR factor
+    case TERM_SLASH:                        // term → term SLASH factor
+    case TERM_PCT: {                        // term → term PCT factor
+        Node *operand = identityOperand(tree);
+        if (operand != NULL) {
+            genValue(operand, dst, depth);
+            break;
+        }
+        if (reduceStrength(tree, dst, depth)) break;
+        genPair(tree->child(0), tree->child(2), dst, depth, a, b);
+        combine(tree, dst, a, b, pool[depth]);
+        break;
+    }
+        
+    case LVALUE_ID:                         // lvalue → ID
+    case LVALUE_STAR:                       // lvalue → STAR factor
+    case LVALUE_PAREN: {                    // lvalue → LPAREN lvalue RPAREN
+        int base, offset;
+        lvalueAddress(tree, dst, depth, base, offset);
+        settleAddress(dst, depth, base, offset);
+        if (base != dst) typeR(OP_ADD, dst, base, 0);
+        break;
+    }
+    case FACTOR_PAREN:                      // factor → LPAREN expr RPAREN
+    case FACTOR_AMP:                        // factor → AMP lvalue
+        genValue(tree->child(1), dst, depth);
+        break;
+        
+    case FACTOR_ID: {                       // factor → ID
+        int r = varRegister(tree);
+        if (r == -1) {
+            typeI_offset(OP_LW, dst, gen->frameReg, symbol(tree->child(0)).offset);
+        } else if (r != dst) {
+            typeR(OP_ADD, dst, r, 0);
+        }
+        break;
+    }
+    case FACTOR_NUM:                        // factor → NUM
+        lis(dst, numValue(tree->child(0)));
+        break;
+    case FACTOR_NULL:                       // factor → NULL
+        typeR(OP_ADD, dst, 11, 0);
+        break;
+    case FACTOR_STAR: {                     // factor → STAR factor
+        int base, offset;
+        pointerAddress(tree->child(1), dst, depth, base, offset);
+        typeI_offset(OP_LW, dst, base, offset);
+        break;
+    }
+    case FACTOR_CALL:                       // factor → ID LPAREN RPAREN
+    case FACTOR_CALL_ARGS:                  // factor → ID LPAREN arglist RPAREN
+        genCall(tree);
+        if (dst != 3) typeR(OP_ADD, dst, 3, 0);
+        break;
+    case FACTOR_NEW: {                      // factor → NEW INT LBRACK expr RBRACK
+        int skip = newLocalLabel("skip", gen->countSkip++);
+        genValue(tree->child(3), 1, 0);
+        typeJump(OP_JALR, 17);
+        typeI_label(OP_BNE, 3, 0, skip);
+        typeR(OP_ADD, 3, 11, 0);            // new is failed
+        placeLabel(skip);
+        if (dst != 3) typeR(OP_ADD, dst, 3, 0);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// test → expr XX expr: branch to target when the test comes out as sense.
+// == and != branch on the operands; the others on one slt against $0,
+// with the branch inverted for <= and >=.
+void testBranch(Node *tree, int target, bool sense) {
+    Opcode cmd = (tree->child(0)->type == INT_TYPE ? OP_SLT : OP_SLTU);
+    int a, b;
+    genPair(tree->child(0), tree->child(2), 3, 0, a, b);
+    
+    switch (tree->prod) {
+    case TEST_EQ:
+        typeI_label(sense ? OP_BEQ : OP_BNE, a, b, target);
+        return;
+    case TEST_NE:
+        typeI_label(sense ? OP_BNE : OP_BEQ, a, b, target);
+        return;
+    case TEST_LT:                           // a < b
+        typeR(cmd, 3, a, b);
+        break;
+    case TEST_GT:                           // b < a
+        typeR(cmd, 3, b, a);
+        break;
+    case TEST_LE:                           // !(b < a)
+        typeR(cmd, 3, b, a);
+        sense = !sense;
+        break;
+    case TEST_GE:                           // !(a < b)
+        typeR(cmd, 3, a, b);
+        sense = !sense;
+        break;
+    default:
+        return;
+    }
+    typeI_label(sense ? OP_BNE : OP_BEQ, 3, 0, target);
+}
+
+// Static guess of whether an if's test usually holds. Two values are
+// seldom equal, so == is taken to fail and != to hold; nothing is assumed
+// about the others.
+bool likelyHolds(Node *test) {
+    return test->prod == TEST_NE;
+}
+
+void mipsTraversal(Node *tree) {
+    switch (tree->prod) {
+    case MAIN: {
+        gen->prog.procs.push_back("wain");
+        enterSource(SRC_ENTRY);
+        init();
+        
+        Procedure &proc = unit->proc[gen->curProc];
+        assignRegisters(tree, proc);
+        enterVariables(proc, 29, false);        // the loader keeps nothing in them
+        typeI_offset(OP_SW, 31, 29, -16);       // nor needs $29 back
+        adjustStack(-frameBytes(proc), 3);
+        
+        if (tree->child(3)->child(0)->prod == TYPE_INT) {
+            typeR(OP_ADD, 2, 0, 0);
+        }
+        typeJump(OP_JALR, 16);
+        
+        mipsTraversal(tree->child(3));
+        mipsTraversal(tree->child(5));
+        mipsTraversal(tree->child(8));
+        mipsTraversal(tree->child(9));
+        if (endless(tree->child(9))) break;     // never returns
+        int entry = enterSource(SRC_RETURN);
+        mipsTraversal(tree->child(11));
+        gen->curSource = entry;
+        // Return to OS
+        typeR(OP_ADD, 30, 29, 0);
+        typeI_offset(OP_LW, 31, 29, -16);
+        typeJump(OP_JR, 31);
+        break;
+    }
+    case PROCEDURE: {
+        Procedure &proc = unit->proc[gen->curProc];
+        int n = (int)proc.params.size();
+        gen->prog.procs.push_back(proc.procName);
+        enterSource(SRC_ENTRY);
+        placeLabel(procLabel(gen->curProc));
+        
+        assignRegisters(tree, proc);
+        enterVariables(proc, 30, !proc.leaf);
+        // A leaf that never spills leaves $30 where it is and addresses its
+        // frame from it; another leaf uses $28, which no one else keeps.
+        if (!proc.leaf) {
+            typeI_offset(OP_SW, 29, 30, -4 * (n + 1));
+            typeI_offset(OP_SW, 31, 30, -4 * (n + 2));
+            gen->frameReg = 29;
+        } else {
+            gen->frameReg = (maySpill(tree) ? 28 : 30);
+        }
+        if (gen->frameReg != 30) {
+            typeR(OP_ADD, gen->frameReg, 30, 0);
+            adjustStack(-frameBytes(proc), 3);
+        }
+        mipsTraversal(tree->child(3));
+        mipsTraversal(tree->child(6));
+        mipsTraversal(tree->child(7));
+        if (endless(tree->child(7))) break;     // never returns
+        int entry = enterSource(SRC_RETURN);
+        mipsTraversal(tree->child(9));
+        gen->curSource = entry;
+        
+        if (gen->frameReg != 30) typeR(OP_ADD, 30, gen->frameReg, 0);
+        if (!proc.leaf) {
+            leaveVariables(proc);
+            typeI_offset(OP_LW, 31, 29, -4 * (n + 2));
+            typeI_offset(OP_LW, 29, 29, -4 * (n + 1));
+        }
+        typeJump(OP_JR, 31);
+        break;
+    }
+        
+    case DCLS_EMPTY:                        // dcls →
+        break;
+    case DCLS_NUM:                          // dcls → dcls dcl BECOMES NUM SEMI
+    case DCLS_NULL: {                       // dcls → dcls dcl BECOMES NULL SEMI
+        mipsTraversal(tree->child(0));
+        mipsTraversal(tree->child(1));
+        Node *id = tree->child(1)->child(1);
+        int value = (tree->prod == DCLS_NUM ? numValue(tree->child(3)) : 1);
+        int r = gen->varRegs[findSymbol(unit->proc[gen->curProc], id)];
+        if (r != -1) {
+            loadConstant(r, value);
+        } else {
+            lis(3, value);
+            typeI_offset(OP_SW, 3, gen->frameReg, symbol(id).offset);
+        }
+        break;
+    }
+    case DCL:                               // dcl → type ID
+        // frame offsets are assigned by procSymbolTable and layoutFrame
+        break;
+        
+    case STATEMENTS_EMPTY:                  // statements →
+        break;
+    case STATEMENTS_STATEMENT: {            // statements → statements statement
+        mipsTraversal(tree->child(0));
+        if (endless(tree->child(0))) break;     // the rest can never run
+        int outer = enterSource(statementKind(tree->child(1)));
+        mipsTraversal(tree->child(1));
+        gen->curSource = outer;
+        break;
+    }
+        
+    case STATEMENT_ASSIGN: {
+        // statement → lvalue BECOMES expr SEMI
+        Node *lvalue = tree->child(0), *expr = tree->child(2);
+        int base, offset, value;
+        int r = varRegister(lvalue);
+        if (r != -1) {
+            genValue(expr, 3, 0);
+            moveResult(3, r);
+            break;
+        }
+        // The value goes first, straight into $3, unless a call in it
+        // could change what finding the address reads.
+        if (lvalue->regs != 0 && (expr->regs != 0 || !readsMemory(lvalue))) {
+            value = operandRegister(expr);
+            if (value == -1) {
+                genValue(expr, 3, 0);
+                value = 3;
+            }
+            lvalueAddress(lvalue, pool[0], 1, base, offset);
+            typeI_offset(OP_SW, value, base, offset);
+            break;
+        }
+        genPair(lvalue, expr, 3, 0, base, value);
+        typeI_offset(OP_SW, value, base, 0);
+        break;
+    }
+    case STATEMENT_PRINTLN:
+        // statement → PRINTLN LPAREN expr RPAREN SEMI
+        genValue(tree->child(2), 1, 0);
+        typeJump(OP_JALR, 15);          // print is initilized in $15
+        break;
+    case STATEMENT_DELETE: {
+        // statement → DELETE LBRACK RBRACK expr SEMI
+        int skip = newLocalLabel("skip", gen->countSkip++);
+        genValue(tree->child(3), 1, 0);
+        typeI_label(OP_BEQ, 1, 11, skip);       // delete NULL does nothing
+        typeJump(OP_JALR, 18);
+        placeLabel(skip);
+        break;
+    }
+    case STATEMENT_WHILE: {
+        // statement → WHILE LPAREN test RPAREN LBRACE statements RBRACK
+        int begin = newLocalLabel("while", gen->countWhile);
+        int end = newLocalLabel("endWhile", gen->countWhile);
+        gen->countWhile++;
+        gen->prog.sources[gen->curSource].label = begin;
+        
+        int known;
+        if (constantOf(tree->child(2), known) && known == 0) break;
+        
+        // Rotated: the test guards the entry once and then closes each
+        // iteration, so the loop runs one branch per pass.
+        bool always = constantOf(tree->child(2), known);
+        if (!always) testBranch(tree->child(2), end, false);
+        placeLabel(begin);
+        mipsTraversal(tree->child(5));
+        if (always) {
+            typeI_label(OP_BEQ, 0, 0, begin);
+            break;                          // nothing branches to the end
+        }
+        if (!endless(tree->child(5))) testBranch(tree->child(2), begin, true);
+        placeLabel(end);
+        break;
+    }
+    case STATEMENT_IF: {
+        // statement → IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE
+        // The arm expected to run is laid out last, falling through to
+        // the end without a jump; an empty arm needs no code at all.
+        Node *test = tree->child(2), *thenArm = tree->child(5), *elseArm = tree->child(9);
+        bool thenLast = likelyHolds(test) && elseArm->prod != STATEMENTS_EMPTY;
+        int second = newLocalLabel(thenLast ? "then" : "else", gen->countIf);
+        int end = newLocalLabel("endif", gen->countIf);
+        gen->countIf++;
+        gen->prog.sources[gen->curSource].label = second;
+        
+        int known;
+        if (constantOf(test, known)) {
+            mipsTraversal(known ? thenArm : elseArm);
+            break;
+        }
+        if (elseArm->prod == STATEMENTS_EMPTY) {
+            testBranch(test, end, false);
+            mipsTraversal(thenArm);
+        } else if (thenArm->prod == STATEMENTS_EMPTY) {
+            testBranch(test, end, true);
+            mipsTraversal(elseArm);
+        } else {
+            Node *first = (thenLast ? elseArm : thenArm);
+            testBranch(test, second, thenLast);
+            mipsTraversal(first);
+            if (!endless(first)) typeI_label(OP_BEQ, 0, 0, end);
+            placeLabel(second);
+            mipsTraversal(thenLast ? thenArm : elseArm);
+        }
+        if (!endless(tree)) placeLabel(end);    // else nothing reaches it
+        break;
+    }
+        
+    case EXPR_TERM:
+    case EXPR_PLUS:
+    case EXPR_MINUS:
+    case TERM_FACTOR:
+    case TERM_STAR:
+    case TERM_SLASH:
+    case TERM_PCT:
+    case FACTOR_ID:
+    case FACTOR_NUM:
+    case FACTOR_NULL:
+    case FACTOR_PAREN:
+    case FACTOR_AMP:
+    case FACTOR_STAR:
+    case FACTOR_NEW:
+    case FACTOR_CALL:
+    case FACTOR_CALL_ARGS:
+        genValue(tree, 3, 0);
+        break;
+        
+    case PARAMS_EMPTY:                      // params →, do nothing
+        break;
+    case PARAMS_LIST:                       // params → paramlist
+    case PARAMLIST_DCL:                     // paramlist → dcl
+        mipsTraversal(tree->child(0));
+        break;
+    case PARAMLIST_COMMA:                   // paramlist → dcl COMMA paramlist
+        mipsTraversal(tree->child(0));
+        mipsTraversal(tree->child(2));
+        break;
+        
+    default:
+        break;
+    }
+}
+
+// Peephole optimization
+
+const int peepholeWindow = 32;          // instructions scanned past a candidate
+
+// Labels, branches and jumps end a straight-line window.
+bool isBarrier(const Instr &in) {
+    return in.op == OP_LABEL || in.op == OP_BEQ || in.op == OP_BNE ||
+           in.op == OP_JR || in.op == OP_JALR;
+}
+
+// Register written by in, or -1.
+int defOf(const Instr &in) {
+    switch (in.op) {
+    case OP_ADD: case OP_SUB: case OP_SLT: case OP_SLTU:
+    case OP_MFHI: case OP_MFLO: case OP_LIS:
+        return in.d;
+    case OP_LW:
+        return in.t;
+    default:
+        return -1;
+    }
+}
+
+bool reads(const Instr &in, int r) {
+    switch (in.op) {
+    case OP_ADD: case OP_SUB: case OP_SLT: case OP_SLTU:
+    case OP_MULT: case OP_MULTU: case OP_DIV: case OP_DIVU:
+    case OP_SW: case OP_BEQ: case OP_BNE:
+        return in.s == r || in.t == r;
+    case OP_LW: case OP_JR: case OP_JALR:
+        return in.s == r;
+    default:
+        return false;
+    }
+}
+
+bool touches(const Instr &in, int r) {
+    return reads(in, r) || defOf(in) == r;
+}
+
+bool isStep(const Instr &in, Opcode op) {        // $30 = $30 op $4
+    return in.op == op && in.d == 30 && in.s == 30 && in.t == 4;
+}
+
+// sw $r, -4($30); sub $30, $30, $4
+bool isPush(const vector<Instr> &code, unsigned long i) {
+    return i + 1 < code.size() && code[i].op == OP_SW && code[i].s == 30 &&
+           code[i].imm == -4 && code[i].t != 30 && isStep(code[i + 1], OP_SUB);
+}
+
+// lw $r, 0($30); add $30, $30, $4
+bool isPop(const vector<Instr> &code, unsigned long i) {
+    return i + 1 < code.size() && code[i].op == OP_LW && code[i].s == 30 &&
+           code[i].imm == 0 && code[i].t != 30 && isStep(code[i + 1], OP_ADD);
+}
+
+// Is r overwritten before it is read again, within a straight-line window?
+bool deadAfter(const vector<Instr> &code, unsigned long from, int r) {
+    unsigned long end = min(code.size(), from + peepholeWindow);
+    for (unsigned long k = from; k < end; ++k) {
+        if (reads(code[k], r) || isBarrier(code[k])) return false;
+        if (defOf(code[k]) == r) return true;
+    }
+    return false;
+}
+
+// push(r) ... pop(r2), where the code in between leaves $30 and r2 alone,
+// becomes a move r2 = r ahead of that code.
+bool forwardPushPop(vector<Instr> &code) {
+    vector<Instr> result;
+    result.reserve(code.size());
+    bool changed = false;
+    for (unsigned long i = 0; i < code.size(); ++i) {
+        if (isPush(code, i)) {
+            int r = code[i].t;
+            unsigned long end = min(code.size(), i + 2 + peepholeWindow);
+            unsigned long j = i + 2;
+            while (j < end && !isPop(code, j) && !isBarrier(code[j]) &&
+                   !touches(code[j], 30)) {
+                ++j;
+            }
+            if (j < end && isPop(code, j)) {
+                int r2 = code[j].t;
+                bool clean = true;
+                for (unsigned long k = i + 2; k < j && clean; ++k) {
+                    clean = !touches(code[k], r2);
+                }
+                if (clean) {
+                    if (r != r2) {
+                        result.push_back(makeInstr(OP_ADD, r2, r, 0, 0, -1));
+                        result.back().source = code[i].source;
+                    }
+                    result.insert(result.end(), code.begin() + i + 2, code.begin() + j);
+                    i = j + 1;
+                    changed = true;
+                    continue;
+                }
+            }
+        }
+        result.push_back(code[i]);
+    }
+    code.swap(result);
+    return changed;
+}
+
+// add $30, $30, $4 ... sub $30, $30, $4 cancel out; stack accesses in
+// between are rebased on the unadjusted $30.
+bool mergeStackSteps(vector<Instr> &code) {
+    vector<bool> drop(code.size(), false);
+    bool changed = false;
+    for (unsigned long i = 0; i < code.size(); ++i) {
+        if (!isStep(code[i], OP_ADD)) continue;
+        unsigned long end = min(code.size(), i + 1 + peepholeWindow);
+        unsigned long j = i + 1;
+        for (; j < end && !isStep(code[j], OP_SUB); ++j) {
+            const Instr &in = code[j];
+            bool baseOnly = (in.op == OP_LW || in.op == OP_SW) && in.t != 30;
+            if (isBarrier(in) || (touches(in, 30) && !baseOnly)) break;
+        }
+        if (j < end && isStep(code[j], OP_SUB)) {
+            for (unsigned long k = i + 1; k < j; ++k) {
+                if (code[k].op == OP_LW || code[k].op == OP_SW) {
+                    if (code[k].s == 30) code[k].imm += 4;
+                }
+            }
+            drop[i] = drop[j] = true;
+            changed = true;
+            i = j;
+        }
+    }
+    if (changed) {
+        unsigned long n = 0;
+        for (unsigned long i = 0; i < code.size(); ++i) {
+            if (!drop[i]) code[n++] = code[i];
+        }
+        code.resize(n);
+    }
+    return changed;
+}
+
+// A load from the address just stored to reuses the stored register.
+bool forwardStores(vector<Instr> &code) {
+    bool changed = false;
+    for (unsigned long i = 0; i < code.size(); ++i) {
+        if (code[i].op != OP_SW) continue;
+        const Instr &st = code[i];
+        unsigned long end = min(code.size(), i + 1 + peepholeWindow);
+        for (unsigned long j = i + 1; j < end; ++j) {
+            Instr &in = code[j];
+            if (in.op == OP_LW && in.s == st.s && in.imm == st.imm) {
+                int source = in.source;
+                in = makeInstr(OP_ADD, in.t, st.t, 0, 0, -1);
+                in.source = source;
+                changed = true;
+                break;
+            }
+            int d = defOf(in);
+            if (isBarrier(in) || in.op == OP_SW || d == st.s || d == st.t) break;
+        }
+    }
+    return changed;
+}
+
+// Drops self-moves and values overwritten before use, and lets the
+// instruction feeding a move write the move's target directly.
+bool cleanMoves(vector<Instr> &code) {
+    vector<bool> drop(code.size(), false);
+    bool changed = false;
+    for (unsigned long i = 0; i < code.size(); ++i) {
+        Instr &in = code[i];
+        int d = defOf(in);
+        if (d <= 0) continue;
+        if (in.op == OP_ADD && ((in.s == d && in.t == 0) || (in.s == 0 && in.t == d))) {
+            drop[i] = changed = true;
+            continue;
+        }
+        if (i + 1 >= code.size()) continue;
+        Instr &next = code[i + 1];
+        if (defOf(next) == d && !reads(next, d)) {
+            drop[i] = changed = true;
+            continue;
+        }
+        if (next.op == OP_ADD && next.s == d && next.t == 0 && next.d != d &&
+            next.d != 0 && deadAfter(code, i + 2, d)) {
+            if (in.op == OP_LW) {
+                in.t = next.d;
+            } else {
+                in.d = next.d;
+            }
+            drop[i + 1] = changed = true;
+            ++i;
+        }
+    }
+    if (changed) {
+        unsigned long n = 0;
+        for (unsigned long i = 0; i < code.size(); ++i) {
+            if (!drop[i]) code[n++] = code[i];
+        }
+        code.resize(n);
+    }
+    return changed;
+}
+
+void peephole(Program &p) {
+    bool changed = true;
+    while (changed) {
+        changed = forwardPushPop(p.code);
+        changed = mergeStackSteps(p.code) || changed;
+        changed = forwardStores(p.code) || changed;
+        changed = cleanMoves(p.code) || changed;
+    }
+}
+
+// Incremental compilation: the optimized code of each procedure is kept in
+// a cache directory under a key of everything it was generated from.
+
+string cacheDir;                            // --cache DIR; off when empty
+const char cacheMagic[8] = "wlp4c09";       // change when codegen changes
+
+struct CacheKey {
+    unsigned long long a, b;                // two independent 64-bit hashes
+};
+
+void hashValue(CacheKey &k, unsigned long long v) {
+    k.a = (k.a ^ v) * 1099511628211ULL;
+    k.b = (k.b + v + 1) * 0x9E3779B97F4A7C15ULL;
+    k.b ^= k.b >> 29;
+}
+
+void hashString(CacheKey &k, const string &s) {
+    for (unsigned long i = 0; i < s.size(); ++i) hashValue(k, (unsigned char)s[i]);
+    hashValue(k, 0x100);
+}
+
+// Key of unit: every line of its subtree in order, the signatures of the procedures
+// it calls and the cache format. Its position among the procedures only
+// shows in local label names, which loadPart renumbers.
+CacheKey unitKey(Node *unitNode) {
+    CacheKey k = { 14695981039346656037ULL, 0x2545F4914F6CDD1DULL };
+    hashString(k, cacheMagic);
+    vector<Node *> stack(1, unitNode);
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        hashValue(k, node->rule->hash);
+        if (node->prod == FACTOR_CALL || node->prod == FACTOR_CALL_ARGS) {
+            const vector<Type> &params = unit->proc[findProc(node->child(0))].params;
+            for (unsigned long i = 0; i < params.size(); ++i) {
+                hashString(k, params[i] == INT_TYPE ? "int" : "int*");
+            }
+        }
+        for (int i = (int)node->numChildren() - 1; i >= 0; --i) stack.push_back(node->child(i));
+    }
+    return k;
+}
+
+string cachePath(const CacheKey &k) {
+    char name[40];
+    snprintf(name, sizeof(name), "/%016llx%016llx", k.a, k.b);
+    return cacheDir + name;
+}
+
+// The name of a local label of proc[from] (see newLocalLabel) moved to
+// proc[to]; other labels are returned unchanged.
+string renumberLabel(const string &name, int from, int to) {
+    unsigned long digits = name.find_first_of("0123456789");
+    unsigned long x = name.find('x', digits);
+    if (name[0] == 'f' || digits == string::npos || x == string::npos ||
+        atoi(name.c_str() + digits) != from) {
+        return name;
+    }
+    Emitter renamed;
+    renamed << name.substr(0, digits) << to << name.substr(x);
+    return renamed.buf;
+}
+
+bool readInt(const string &data, unsigned long &pos, int &value) {
+    if (pos + sizeof(int) > data.size()) return false;
+    memcpy(&value, data.data() + pos, sizeof(int));
+    pos += sizeof(int);
+    return true;
+}
+
+// Cache file: magic, procedure index, labels, imports, then the raw code
+// and sources. It is read in one piece and decoded from memory.
+bool loadPart(const CacheKey &k, int index, Program &part) {
+    FILE *f = fopen(cachePath(k).c_str(), "rb");
+    if (f == NULL) return false;
+    string data;
+    char chunk[65536];
+    unsigned long got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) data.append(chunk, got);
+    fclose(f);
+    
+    unsigned long pos = 0;
+    int from = 0, count = 0;
+    bool ok = data.size() >= 8 && memcmp(data.data(), cacheMagic, 8) == 0;
+    pos = 8;
+    ok = ok && readInt(data, pos, from) && readInt(data, pos, count);
+    for (int i = 0; ok && i < count; ++i) {
+        int len = 0;
+        ok = readInt(data, pos, len) && len >= 0 && pos + len <= data.size();
+        if (ok) {
+            part.labels.push_back(renumberLabel(data.substr(pos, len), from, index));
+            pos += len;
+        }
+    }
+    ok = ok && readInt(data, pos, count) && count >= 0 &&
+         pos + count * sizeof(int) <= data.size();
+    if (ok) {
+        part.imports.resize(count);
+        memcpy(part.imports.data(), data.data() + pos, count * sizeof(int));
+        pos += count * sizeof(int);
+    }
+    ok = ok && readInt(data, pos, count) && count >= 0 &&
+         pos + count * sizeof(Instr) <= data.size();
+    if (ok) {
+        part.code.resize(count);
+        memcpy(part.code.data(), data.data() + pos, count * sizeof(Instr));
+        pos += count * sizeof(Instr);
+    }
+    ok = ok && readInt(data, pos, count) && count >= 0 &&
+         pos + count * sizeof(Source) == data.size();
+    if (ok) {
+        part.sources.resize(count);
+        memcpy(part.sources.data(), data.data() + pos, count * sizeof(Source));
+        part.procs.push_back(unit->proc[index].procName);
+    }
+    if (!ok) part = Program();
+    return ok;
+}
+
+// Written to a temporary name first so that concurrent compilations never
+// see a partial file.
+void storePart(const CacheKey &k, int index, const Program &part) {
+    string path = cachePath(k);
+    Emitter tmp;
+    tmp << path << ".tmp" << (int)(std::hash<std::thread::id>()(std::this_thread::get_id()) & 0x7fffffff);
+    FILE *f = fopen(tmp.buf.c_str(), "wb");
+    if (f == NULL) return;
+    int count = (int)part.labels.size();
+    bool ok = fwrite(cacheMagic, 1, 8, f) == 8 && fwrite(&index, sizeof(int), 1, f) == 1 &&
+              fwrite(&count, sizeof(int), 1, f) == 1;
+    for (int i = 0; ok && i < count; ++i) {
+        int len = (int)part.labels[i].size();
+        ok = fwrite(&len, sizeof(int), 1, f) == 1 &&
+             fwrite(part.labels[i].data(), 1, len, f) == (unsigned long)len;
+    }
+    count = (int)part.imports.size();
+    ok = ok && fwrite(&count, sizeof(int), 1, f) == 1 &&
+         fwrite(part.imports.data(), sizeof(int), count, f) == (unsigned long)count;
+    count = (int)part.code.size();
+    ok = ok && fwrite(&count, sizeof(int), 1, f) == 1 &&
+         fwrite(part.code.data(), sizeof(Instr), count, f) == (unsigned long)count;
+    count = (int)part.sources.size();
+    ok = ok && fwrite(&count, sizeof(int), 1, f) == 1 &&
+         fwrite(part.sources.data(), sizeof(Source), count, f) == (unsigned long)count;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.buf.c_str(), path.c_str()) != 0) remove(tmp.buf.c_str());
+}
+
+// Append part to p, mapping its labels onto p's by name so that calls
+// between parts meet at one label per procedure.
+void appendProgram(Program &p, const Program &part, unordered_map<string, int> &names) {
+    vector<int> remap(part.labels.size());
+    for (unsigned long i = 0; i < part.labels.size(); ++i) {
+        unordered_map<string, int>::const_iterator it = names.find(part.labels[i]);
+        if (it == names.end()) {
+            remap[i] = p.newLabel(part.labels[i]);
+            names[part.labels[i]] = remap[i];
+        } else {
+            remap[i] = it->second;
+        }
+    }
+    for (unsigned long i = 0; i < part.imports.size(); ++i) {
+        p.imports.push_back(remap[part.imports[i]]);
+    }
+    int procBase = (int)p.procs.size();
+    int sourceBase = (int)p.sources.size();
+    p.procs.insert(p.procs.end(), part.procs.begin(), part.procs.end());
+    for (unsigned long i = 0; i < part.sources.size(); ++i) {
+        Source src = part.sources[i];
+        src.proc += procBase;
+        if (src.label != -1) src.label = remap[src.label];
+        if (src.parent != -1) src.parent += sourceBase;
+        p.sources.push_back(src);
+    }
+    unsigned long start = p.code.size();
+    p.code.insert(p.code.end(), part.code.begin(), part.code.end());
+    for (unsigned long i = start; i < p.code.size(); ++i) {
+        if (p.code[i].label != -1) p.code[i].label = remap[p.code[i].label];
+        if (p.code[i].source != -1) p.code[i].source += sourceBase;
+    }
+}
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Worker: take the next unit, generate and optimize it into its part.
+void generateUnits(Compilation *c, const vector<Node *> *units,
+                   vector<Program> *parts, std::atomic<unsigned long> *next) {
+    unit = c;
+    for (;;) {
+        unsigned long i = (*next)++;
+        if (i >= units->size()) break;
+        
+        int index = findProc((*units)[i]->child(1));
+        CacheKey key;
+        if (!cacheDir.empty()) {
+            key = unitKey((*units)[i]);
+            if (loadPart(key, index, (*parts)[i])) {
+                ++c->cached;
+                continue;
+            }
+        }
+        
+        CodeGen cg;
+        cg.curProc = index;
+        cg.frameReg = 29;
+        cg.temps = poolSize;
+        cg.countWhile = cg.countIf = cg.countSkip = 0;
+        cg.pushes = cg.pops = cg.lisConstants = 0;
+        cg.curSource = -1;
+        cg.countStatement = 0;
+        gen = &cg;
+        mipsTraversal((*units)[i]);
+        Clock::time_point start = Clock::now();
+        peephole(cg.prog);
+        c->peepholeNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        ++c->generated;
+        c->pushes += cg.pushes;
+        c->pops += cg.pops;
+        c->lisConstants += cg.lisConstants;
+        if (!cacheDir.empty()) storePart(key, index, cg.prog);
+        (*parts)[i] = std::move(cg.prog);
+    }
+    gen = NULL;
+}
+
+// Generate main, then the other procedures from last to first, on up to
+// threads threads. The parts are joined in that order, so the output is
+// the same whatever the thread count or timing.
+void generate(Node *procedures, Program &p, unsigned int threads) {
+    vector<Node *> units;
+    for (Node *node = procedures; ; node = node->child(1)) {
+        if (unit->proc[findProc(node->child(0)->child(1))].reachable) units.push_back(node->child(0));
+        if (node->prod == PROCEDURES_MAIN) break;
+    }
+    std::reverse(units.begin(), units.end());
+    
+    vector<Program> parts(units.size());
+    std::atomic<unsigned long> next(0);
+    if (threads > units.size()) threads = (unsigned int)units.size();
+    vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads; ++i) {
+        pool.push_back(std::thread(generateUnits, unit, &units, &parts, &next));
+    }
+    generateUnits(unit, &units, &parts, &next);
+    for (unsigned long i = 0; i < pool.size(); ++i) pool[i].join();
+    
+    unordered_map<string, int> names;
+    for (unsigned long i = 0; i < parts.size(); ++i) {
+        appendProgram(p, parts[i], names);
+    }
+}
+
+const int numProds = LVALUE_PAREN + 1;
+const int numOps = OP_LABEL + 1;
+
+// Where compile() spends its time and what it produced, for --stats and
+// the benchmarks.
+struct CompileStats {
+    double parse, check, generate;          // seconds per phase
+    double peephole;                        // within generate, summed over threads
+    double print;                           // set by the caller
+    unsigned long nodes;
+    unsigned long prodNodes[numProds];      // nodes per production, TERMINAL first
+    unsigned long procs, symbols, maxSymbols;
+    unsigned long generated, cached, unreachable;   // procedures
+    unsigned long pushes, pops, lisConstants;
+};
+
+// Compile the parse tree listing read from in into prog, generating on up
+// to threads threads. Returns false with err set when the program is
+// rejected. Fills in stats when it is given.
+bool compile(istream &in, Program &prog, unsigned int threads, string &err,
+             CompileStats *stats = NULL) {
+    Compilation c;
+    unit = &c;
+    ParseTree tree;
+    double seconds[3] = { 0, 0, 0 };
+    Clock::time_point start = Clock::now();
+    buildTree(in, tree);
+    Node *parseTree = tree.root();
+    seconds[0] = secondsSince(start);
+    
+    bool ok = true;
+    try {
+        start = Clock::now();
+        buildSymbolTable(parseTree);
+        markReachable(parseTree->child(1));
+        // printSymbolTable();
+        seconds[1] = secondsSince(start);
+        start = Clock::now();
+        generate(parseTree->child(1), prog, threads);
+        seconds[2] = secondsSince(start);
+    } catch (string e) {
+        err = e;
+        ok = false;
+    }
+    
+    if (stats != NULL) {
+        stats->parse = seconds[0];
+        stats->check = seconds[1];
+        stats->generate = seconds[2];
+        stats->peephole = c.peepholeNanos / 1e9;
+        stats->print = 0;
+        stats->nodes = tree.nodes.size();
+        std::fill(stats->prodNodes, stats->prodNodes + numProds, 0);
+        for (unsigned long i = 0; i < tree.nodes.size(); ++i) ++stats->prodNodes[tree.nodes[i].prod];
+        stats->procs = c.proc.size();
+        stats->symbols = stats->maxSymbols = stats->unreachable = 0;
+        for (unsigned long i = 0; i < c.proc.size(); ++i) {
+            if (!c.proc[i].reachable) ++stats->unreachable;
+            stats->symbols += c.proc[i].symbols.size();
+            stats->maxSymbols = std::max(stats->maxSymbols, (unsigned long)c.proc[i].symbols.size());
+        }
+        stats->generated = c.generated;
+        stats->cached = c.cached;
+        stats->pushes = c.pushes;
+        stats->pops = c.pops;
+        stats->lisConstants = c.lisConstants;
+    }
+    unit = NULL;
+    return ok;
+}
+
+bool merlOutput;                            // --merl: an object, not assembly
+
+// Write prog to outFile (stdout when empty) as assembly text, with --merl
+// as a big-endian MERL object, or with --link as a linked image to load
+// at 0. Returns false with err set.
+bool writeProgram(const Program &prog, const string &outFile, string &err) {
+    Emitter out;
+    if (merlOutput || !runtimeObjects.empty()) {
+        vector<unsigned int> words;
+        try {
+            encodeMerl(prog, words);
+            if (!runtimeObjects.empty()) {
+                MerlModule object;
+                object.name = "output";
+                parseMerl(words, object);
+                vector<const MerlModule *> modules(1, &object);
+                for (unsigned long i = 0; i < runtimeObjects.size(); ++i) modules.push_back(&runtimeObjects[i]);
+                linkImage(modules, words);
+            }
+        } catch (string e) {
+            err = e;
+            return false;
+        }
+        out.buf.resize(4 * words.size());
+        for (unsigned long i = 0; i < words.size(); ++i) {
+            for (int k = 0; k < 4; ++k) out.buf[4 * i + k] = (char)(words[i] >> (24 - 8 * k));
+        }
+    } else {
+        printProgram(prog, out);
+    }
+    FILE *f = (outFile.empty() ? stdout : fopen(outFile.c_str(), "wb"));
+    bool ok = (f != NULL && out.writeTo(f));
+    if (f != NULL && f != stdout) ok = (fclose(f) == 0) && ok;
+    if (!ok) err = "ERROR: cannot write " + (outFile.empty() ? string("output") : outFile);
+    if (!ok && f != NULL && f != stdout) remove(outFile.c_str());   // no half an object
+    return ok;
+}
+
+// Report stats on stderr: the phase times, and with all the tree, symbol
+// table and code counts too. Aligned text, or one JSON object with json.
+void reportStats(const CompileStats &st, const Program &prog, bool all, bool json) {
+    unsigned long ops[numOps] = {};
+    unsigned long words = 0;
+    for (unsigned long i = 0; i < prog.code.size(); ++i) {
+        int op = prog.code[i].op;
+        ++ops[op];
+        if (op != OP_LABEL) words += (op == OP_LIS ? 2 : 1);
+    }
+    const char *const phases[] = { "parse", "check", "generate", "peephole", "print", "total" };
+    double times[] = { st.parse, st.check, st.generate, st.peephole, st.print,
+                       st.parse + st.check + st.generate + st.print };
+    const int numPhases = sizeof(times) / sizeof(times[0]);
+    
+    Emitter out;
+    char line[160];
+    if (json) {
+        out << "{\"seconds\":{";
+        for (int i = 0; i < numPhases; ++i) {
+            snprintf(line, sizeof(line), "%s\"%s\":%.6f", (i ? "," : ""), phases[i], times[i]);
+            out << line;
+        }
+        out << '}';
+        if (all) {
+            out << ",\"nodes\":" << st.nodes << ",\"productions\":{\"terminals\":" << st.prodNodes[TERMINAL];
+            for (unsigned long i = 0; i < sizeof(grammar) / sizeof(grammar[0]); ++i) {
+                unsigned long n = st.prodNodes[grammar[i].prod];
+                if (n != 0) out << ",\"" << grammar[i].rule << "\":" << n;
+            }
+            out << "},\"procedures\":" << st.procs << ",\"symbols\":" << st.symbols
+                << ",\"max_symbols\":" << st.maxSymbols << ",\"generated\":" << st.generated
+                << ",\"cached\":" << st.cached << ",\"unreachable\":" << st.unreachable
+                << ",\"push_calls\":" << st.pushes
+                << ",\"pop_calls\":" << st.pops << ",\"lis_constants\":" << st.lisConstants
+                << ",\"instructions\":" << (prog.code.size() - ops[OP_LABEL])
+                << ",\"words\":" << words << ",\"labels\":" << ops[OP_LABEL] << ",\"opcodes\":{";
+            bool first = true;
+            for (int op = 0; op < OP_LABEL; ++op) {
+                if (ops[op] == 0) continue;
+                out << (first ? "\"" : ",\"") << opNames[op] << "\":" << ops[op];
+                first = false;
+            }
+            out << '}';
+        }
+        out << "}\n";
+    } else {
+        for (int i = 0; i < numPhases; ++i) {
+            // peephole is part of generate, and summed over the threads
+            snprintf(line, sizeof(line), "%-12s %10.6fs\n",
+                     (i == 3 ? "  peephole" : phases[i]), times[i]);
+            out << line;
+        }
+        if (all) {
+            snprintf(line, sizeof(line), "%-12s %10lu\n", "nodes", st.nodes);
+            out << line;
+            snprintf(line, sizeof(line), "  %10lu  terminals\n", st.prodNodes[TERMINAL]);
+            out << line;
+            for (unsigned long i = 0; i < sizeof(grammar) / sizeof(grammar[0]); ++i) {
+                unsigned long n = st.prodNodes[grammar[i].prod];
+                if (n == 0) continue;
+                snprintf(line, sizeof(line), "  %10lu  %s\n", n, grammar[i].rule);
+                out << line;
+            }
+            out << "procedures " << st.procs << " (" << st.generated << " generated, " << st.cached
+                << " cached, " << st.unreachable << " unreachable), symbols " << st.symbols
+                << ", most in one " << st.maxSymbols << '\n';
+            out << "push calls " << st.pushes << ", pop calls " << st.pops
+                << ", lis constants " << st.lisConstants << '\n';
+            out << "instructions " << (prog.code.size() - ops[OP_LABEL]) << ", words " << words
+                << ", labels " << ops[OP_LABEL] << '\n';
+            for (int op = 0; op < OP_LABEL; ++op) {
+                if (ops[op] == 0) continue;
+                snprintf(line, sizeof(line), "  %10lu  %s\n", ops[op], opNames[op]);
+                out << line;
+            }
+        }
+    }
+    out.writeTo(stderr);
+}
+
+struct BatchJob {
+    string in, out;
+    string status;                          // "ok", or the error
+};
+
+// Worker: compile jobs until none are left, one thread per file.
+void compileJobs(vector<BatchJob> *jobs, std::atomic<unsigned long> *next) {
+    for (;;) {
+        unsigned long i = (*next)++;
+        if (i >= jobs->size()) break;
+        BatchJob &job = (*jobs)[i];
+        
+        std::ifstream in(job.in.c_str());
+        Program prog;
+        string err;
+        if (!in) {
+            job.status = "ERROR: cannot read " + job.in;
+        } else if (!compile(in, prog, 1, err)) {
+            job.status = err;
+        } else if (!writeProgram(prog, job.out, err)) {
+            job.status = err;
+        } else {
+            job.status = "ok";
+        }
+    }
+}
+
+// --batch LIST: compile every "input output" pair listed in LIST ("-" for
+// stdin) with fresh state per file, threads files at a time. Prints one
+// status line per file, in list order, then the throughput.
+int runBatch(const string &listFile, unsigned int threads) {
+    std::ifstream listStream;
+    if (listFile != "-") listStream.open(listFile.c_str());
+    istream &list = (listFile == "-" ? std::cin : listStream);
+    if (!list) {
+        cerr << "ERROR: cannot read " << listFile << endl;
+        return 1;
+    }
+    
+    vector<BatchJob> jobs;
+    string line;
+    while (getline(list, line)) {
+        BatchJob job;
+        stringstream fields(line);
+        if (!(fields >> job.in)) continue;  // blank line
+        if (!(fields >> job.out)) {
+            cerr << "ERROR: no output file for " << job.in << endl;
+            return 1;
+        }
+        jobs.push_back(job);
+    }
+    
+    Clock::time_point start = Clock::now();
+    std::atomic<unsigned long> next(0);
+    if (threads > jobs.size()) threads = (unsigned int)jobs.size();
+    vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads; ++i) {
+        pool.push_back(std::thread(compileJobs, &jobs, &next));
+    }
+    compileJobs(&jobs, &next);
+    for (unsigned long i = 0; i < pool.size(); ++i) pool[i].join();
+    double seconds = secondsSince(start);
+    
+    Emitter report;
+    int failed = 0;
+    for (unsigned long i = 0; i < jobs.size(); ++i) {
+        report << jobs[i].in << ": " << jobs[i].status << '\n';
+        if (jobs[i].status != "ok") ++failed;
+    }
+    char rate[64];
+    snprintf(rate, sizeof(rate), "%.3fs, %.1f files/s", seconds,
+             (seconds > 0 ? jobs.size() / seconds : 0.0));
+    report << (int)jobs.size() << " files, " << failed << " failed, " << rate << '\n';
+    report.writeTo(stdout);
+    return (failed == 0 ? 0 : 1);
+}
+
+// Emulator for generated programs, so their cost can be measured without
+// assembling and linking them. It runs the Program directly, laid out as
+// the assembler would, with native stand-ins for the runtime imports.
+
+const unsigned int memBytes = 0x01000000;       // also the initial $30
+const unsigned int returnAddress = 0x8123456c;  // $31 on entry; jr to it exits
+const unsigned int heapBytes = 4096;            // alloc.merl's pool, after the data
+const unsigned int minBlockBytes = 16;
+const int multCycles = 12, divCycles = 35;      // R3000 latencies
+const unsigned long long runLimit = 10000000000ULL;
+
+struct RunStats {
+    int result;                             // $3 on exit
+    unsigned long long executed;
+    unsigned long long ops[numOps];
+    unsigned long long cycles;
+    unsigned long long loads, stores;
+    unsigned long long calls[4];            // print, init, new, delete
+    unsigned int peakStack;                 // bytes below the initial $30
+    unsigned int peakHeap;                  // bytes allocated at once
+    vector<unsigned long long> hits;        // runs of each instruction, labels skipped
+    vector<unsigned long long> entries;     // jalr arrivals at each instruction
+};
+
+// Heap for the native new and delete, sized and split like alloc.merl:
+// a buddy system over heapBytes, where a block is a power of two of at
+// least minBlockBytes and its first word is a header ahead of the array.
+struct Heap {
+    unsigned int base;                      // start of the pool
+    map<unsigned int, unsigned int> freeBlocks;     // address → bytes
+    unordered_map<unsigned int, unsigned int> used; // block address → bytes
+    unsigned int inUse, peak;
+    
+    void reset(unsigned int start) {
+        base = start;
+        freeBlocks.clear();
+        freeBlocks[base] = heapBytes;
+        used.clear();
+        inUse = peak = 0;
+    }
+    
+    unsigned int allocate(int words) {
+        if (words < 1 || words >= (int)(heapBytes / 4)) return 0;  // like alloc.merl
+        unsigned int bytes = minBlockBytes;
+        while (bytes < 4u * (unsigned int)(words + 1)) bytes *= 2;
+        // the smallest free block that fits, lowest first, halved to size
+        map<unsigned int, unsigned int>::iterator best = freeBlocks.end();
+        for (map<unsigned int, unsigned int>::iterator it = freeBlocks.begin();
+             it != freeBlocks.end(); ++it) {
+            if (it->second >= bytes && (best == freeBlocks.end() || it->second < best->second)) best = it;
+        }
+        if (best == freeBlocks.end()) return 0;
+        unsigned int addr = best->first, size = best->second;
+        freeBlocks.erase(best);
+        while (size > bytes) {
+            size /= 2;
+            freeBlocks[addr + size] = size;
+        }
+        used[addr] = bytes;
+        inUse += bytes;
+        if (inUse > peak) peak = inUse;
+        return addr + 4;
+    }
+    
+    bool release(unsigned int addr) {
+        unordered_map<unsigned int, unsigned int>::iterator it = used.find(addr - 4);
+        if (it == used.end()) return false;
+        unsigned int block = it->first, size = it->second;
+        inUse -= size;
+        used.erase(it);
+        // merge with the free buddy as far as it goes
+        while (size < heapBytes) {
+            unsigned int buddy = base + ((block - base) ^ size);
+            map<unsigned int, unsigned int>::iterator b = freeBlocks.find(buddy);
+            if (b == freeBlocks.end() || b->second != size) break;
+            freeBlocks.erase(b);
+            block = std::min(block, buddy);
+            size *= 2;
+        }
+        freeBlocks[block] = size;
+        return true;
+    }
+};
+
+// Run prog as wain(a, b), or with array as wain(array, length), appending
+// what it prints to out. Throws on a fault or when it runs too long.
+void runProgram(const Program &prog, int a, int b, const vector<int> *array,
+                Emitter &out, RunStats &st) {
+    string err;
+    vector<unsigned int> labelAddr;
+    unsigned int nativeBase = layoutLabels(prog, 0, labelAddr);    // one word per runtime routine
+    vector<Instr> code;
+    vector<unsigned int> addrOf;            // address of each instruction
+    unsigned int addr = 0;
+    for (unsigned long i = 0; i < prog.code.size(); ++i) {
+        const Instr &in = prog.code[i];
+        if (in.op == OP_LABEL) continue;
+        code.push_back(in);
+        addrOf.push_back(addr);
+        addr += (in.op == OP_LIS ? 8 : 4);
+    }
+    unsigned long end = code.size();
+    addrOf.push_back(nativeBase);
+    static const char *const runtime[] = { "print", "init", "new", "delete" };
+    for (unsigned long i = 0; i < prog.imports.size(); ++i) {
+        int label = prog.imports[i];
+        const char *const *found = std::find(runtime, runtime + 4, prog.labels[label]);
+        if (found == runtime + 4) {
+            err = "ERROR: unknown import " + prog.labels[label];
+            throw err;
+        }
+        labelAddr[label] = nativeBase + 4 * (unsigned int)(found - runtime);
+    }
+    
+    // Resolve labels; jumps go by address, so map addresses back to slots.
+    vector<int> slotAt(nativeBase / 4 + 1, -1);
+    for (unsigned long i = 0; i <= end; ++i) slotAt[addrOf[i] / 4] = (int)i;
+    vector<int> target(end, 0);
+    for (unsigned long i = 0; i < end; ++i) {
+        if (code[i].label == -1) continue;
+        unsigned int dest = labelAddr[code[i].label];
+        if (dest == noAddress) {
+            err = "ERROR: label " + prog.labels[code[i].label] + " is not defined";
+            throw err;
+        }
+        if (code[i].op == OP_LIS) {
+            code[i].imm = (int)dest;
+        } else {
+            target[i] = slotAt[dest / 4];
+        }
+    }
+    
+    vector<int> mem(memBytes / 4, 0);
+    unsigned int reg[32] = {};
+    reg[30] = memBytes;
+    reg[31] = returnAddress;
+    unsigned int dataEnd = nativeBase + 16;
+    if (array != NULL) {
+        for (unsigned long i = 0; i < array->size(); ++i) mem[dataEnd / 4 + i] = (*array)[i];
+        reg[1] = dataEnd;
+        reg[2] = (unsigned int)array->size();
+        dataEnd += 4 * (unsigned int)array->size();
+    } else {
+        reg[1] = (unsigned int)a;
+        reg[2] = (unsigned int)b;
+    }
+    Heap heap;
+    heap.reset(dataEnd);
+    
+    std::fill(st.ops, st.ops + numOps, 0);
+    std::fill(st.calls, st.calls + 4, 0);
+    st.hits.assign(end, 0);
+    st.entries.assign(end, 0);
+    unsigned long long *hits = st.hits.data();
+    st.executed = st.cycles = st.loads = st.stores = 0;
+    unsigned int lowSp = memBytes;
+    unsigned int hi = 0, lo = 0;
+    unsigned long pc = 0;
+    for (;;) {
+        if (pc >= end) {
+            err = "ERROR: ran off the end of the program";
+            throw err;
+        }
+        if (++st.executed > runLimit) {
+            err = "ERROR: instruction limit reached";
+            throw err;
+        }
+        ++hits[pc];
+        const Instr &in = code[pc++];
+        unsigned int s = reg[in.s], t = reg[in.t];
+        switch (in.op) {
+        case OP_ADD:  reg[in.d] = s + t; break;
+        case OP_SUB:  reg[in.d] = s - t; break;
+        case OP_SLT:  reg[in.d] = ((int)s < (int)t); break;
+        case OP_SLTU: reg[in.d] = (s < t); break;
+        case OP_MULT: {
+            long long p = (long long)(int)s * (int)t;
+            lo = (unsigned int)p;
+            hi = (unsigned int)((unsigned long long)p >> 32);
+            st.cycles += multCycles - 1;
+            break;
+        }
+        case OP_MULTU: {
+            unsigned long long p = (unsigned long long)s * t;
+            lo = (unsigned int)p;
+            hi = (unsigned int)(p >> 32);
+            st.cycles += multCycles - 1;
+            break;
+        }
+        case OP_DIV:
+        case OP_DIVU:
+            if (t == 0) {
+                err = "ERROR: division by zero";
+                throw err;
+            }
+            if (in.op == OP_DIVU) {
+                lo = s / t;
+                hi = s % t;
+            } else if ((int)s == INT_MIN && (int)t == -1) {
+                lo = s;
+                hi = 0;
+            } else {
+                lo = (unsigned int)((int)s / (int)t);
+                hi = (unsigned int)((int)s % (int)t);
+            }
+            st.cycles += divCycles - 1;
+            break;
+        case OP_MFHI: reg[in.d] = hi; break;
+        case OP_MFLO: reg[in.d] = lo; break;
+        case OP_LIS:  reg[in.d] = (unsigned int)in.imm; break;
+        case OP_LW:
+        case OP_SW: {
+            unsigned int at = s + (unsigned int)in.imm;
+            if (at % 4 != 0 || at >= memBytes) {
+                char where[16];
+                snprintf(where, sizeof(where), "0x%08x", at);
+                err = string("ERROR: ") + opNames[in.op] + " from bad address " + where;
+                throw err;
+            }
+            if (in.op == OP_LW) {
+                reg[in.t] = (unsigned int)mem[at / 4];
+                ++st.loads;
+            } else {
+                mem[at / 4] = (int)t;
+                ++st.stores;
+            }
+            break;
+        }
+        case OP_BEQ:
+            if (s == t) pc = target[pc - 1];
+            break;
+        case OP_BNE:
+            if (s != t) pc = target[pc - 1];
+            break;
+        case OP_JR:
+        case OP_JALR: {
+            if (in.op == OP_JALR) reg[31] = addrOf[pc];
+            unsigned int dest = s;
+            if (dest % 4 == 0 && dest >= nativeBase && dest < nativeBase + 16) {
+                int routine = (dest - nativeBase) / 4;  // returns to $31 at once
+                ++st.calls[routine];
+                if (routine == 0) {
+                    out << (int)reg[1] << '\n';
+                } else if (routine == 2) {
+                    reg[3] = heap.allocate((int)reg[1]);
+                } else if (routine == 3 && !heap.release(reg[1])) {
+                    err = "ERROR: delete of memory that new did not return";
+                    throw err;
+                }
+                dest = reg[31];
+            }
+            if (dest == returnAddress) {
+                for (unsigned long i = 0; i < end; ++i) st.ops[code[i].op] += hits[i];
+                st.result = (int)reg[3];
+                st.cycles += st.executed;
+                st.peakStack = memBytes - lowSp;
+                st.peakHeap = heap.peak;
+                return;
+            }
+            if (dest % 4 != 0 || dest >= nativeBase || slotAt[dest / 4] == -1) {
+                err = string("ERROR: ") + opNames[in.op] + " to a bad address";
+                throw err;
+            }
+            pc = slotAt[dest / 4];
+            if (in.op == OP_JALR) ++st.entries[pc];
+            break;
+        }
+        default:
+            break;
+        }
+        reg[0] = 0;
+        if (reg[30] < lowSp) lowSp = reg[30];
+    }
+}
+
+// Report a run on stderr, as aligned text or one JSON object.
+void reportRun(const RunStats &st, bool json) {
+    static const char *const runtime[] = { "print", "init", "new", "delete" };
+    Emitter out;
+    char line[200];
+    if (json) {
+        snprintf(line, sizeof(line),
+                 "{\"result\":%d,\"instructions\":%llu,\"cycles\":%llu,\"loads\":%llu,"
+                 "\"stores\":%llu,\"load_bytes\":%llu,\"store_bytes\":%llu,"
+                 "\"peak_stack_bytes\":%u,\"peak_heap_bytes\":%u,\"calls\":{",
+                 st.result, st.executed, st.cycles, st.loads, st.stores,
+                 4 * st.loads, 4 * st.stores, st.peakStack, st.peakHeap);
+        out << line;
+        for (int i = 0; i < 4; ++i) {
+            snprintf(line, sizeof(line), "%s\"%s\":%llu", (i ? "," : ""), runtime[i], st.calls[i]);
+            out << line;
+        }
+        out << "},\"opcodes\":{";
+        bool first = true;
+        for (int op = 0; op < OP_LABEL; ++op) {
+            if (st.ops[op] == 0) continue;
+            snprintf(line, sizeof(line), "%s\"%s\":%llu", (first ? "" : ","), opNames[op], st.ops[op]);
+            out << line;
+            first = false;
+        }
+        out << "}}\n";
+    } else {
+        snprintf(line, sizeof(line),
+                 "result       %d\n"
+                 "instructions %llu\n"
+                 "cycles       %llu (mult %d, div %d, others 1)\n"
+                 "loads        %llu (%llu bytes)\n"
+                 "stores       %llu (%llu bytes)\n"
+                 "peak stack   %u bytes\n"
+                 "peak heap    %u bytes\n",
+                 st.result, st.executed, st.cycles, multCycles, divCycles,
+                 st.loads, 4 * st.loads, st.stores, 4 * st.stores, st.peakStack, st.peakHeap);
+        out << line;
+        snprintf(line, sizeof(line), "calls        print %llu, init %llu, new %llu, delete %llu\n",
+                 st.calls[0], st.calls[1], st.calls[2], st.calls[3]);
+        out << line;
+        for (int op = 0; op < OP_LABEL; ++op) {
+            if (st.ops[op] == 0) continue;
+            snprintf(line, sizeof(line), "  %12llu  %s\n", st.ops[op], opNames[op]);
+            out << line;
+        }
+    }
+    out.writeTo(stderr);
+}
+
+// Profile of a run on stderr: instructions executed per procedure with its
+// calls, inside each while and if (including what they contain), and by
+// each statement itself. Text shows the top entries, JSON all of them.
+void reportProfile(const Program &prog, const RunStats &st, bool json) {
+    const int topCount = 20;
+    unsigned long long total = 0;
+    vector<unsigned long long> self(prog.sources.size(), 0);
+    vector<unsigned long long> procCount(prog.procs.size(), 0), procCalls(prog.procs.size(), 0);
+    unordered_map<string, int> procOf;      // entry label → procedure
+    for (unsigned long p = 0; p < prog.procs.size(); ++p) procOf["f" + prog.procs[p]] = (int)p;
+    
+    unsigned long slot = 0;
+    for (unsigned long i = 0; i < prog.code.size(); ++i) {
+        const Instr &in = prog.code[i];
+        if (in.op == OP_LABEL) {
+            unordered_map<string, int>::const_iterator it = procOf.find(prog.labels[in.label]);
+            if (it != procOf.end() && slot < st.entries.size()) procCalls[it->second] += st.entries[slot];
+            continue;
+        }
+        unsigned long long n = st.hits[slot++];
+        total += n;
+        if (in.source != -1) self[in.source] += n;
+    }
+    vector<unsigned long long> inside(self);
+    for (int i = (int)prog.sources.size() - 1; i >= 0; --i) {
+        const Source &src = prog.sources[i];
+        procCount[src.proc] += self[i];
+        if (src.parent != -1) inside[src.parent] += inside[i];
+    }
+    for (unsigned long p = 0; p < prog.procs.size(); ++p) {
+        if (prog.procs[p] == "wain") procCalls[p] = 1;  // called by the loader
+    }
+    
+    vector<pair<unsigned long long, int> > loops, statements;
+    for (unsigned long i = 0; i < prog.sources.size(); ++i) {
+        int kind = prog.sources[i].kind;
+        if ((kind == SRC_WHILE || kind == SRC_IF) && inside[i] != 0) loops.push_back(make_pair(inside[i], -(int)i));
+        if (self[i] != 0) statements.push_back(make_pair(self[i], -(int)i));
+    }
+    std::sort(loops.rbegin(), loops.rend());        // most first, then in source order
+    std::sort(statements.rbegin(), statements.rend());
+    
+    Emitter out;
+    char line[300];
+    if (json) {
+        out << "{\"instructions\":" << (unsigned long)total << ",\"procedures\":[";
+        for (unsigned long p = 0; p < prog.procs.size(); ++p) {
+            snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"calls\":%llu,\"instructions\":%llu}",
+                     (p ? "," : ""), prog.procs[p].c_str(), procCalls[p], procCount[p]);
+            out << line;
+        }
+        for (int list = 0; list < 2; ++list) {
+            vector<pair<unsigned long long, int> > &entries = (list == 0 ? loops : statements);
+            out << (list == 0 ? "],\"loops\":[" : "],\"statements\":[");
+            for (unsigned long k = 0; k < entries.size(); ++k) {
+                const Source &src = prog.sources[-entries[k].second];
+                snprintf(line, sizeof(line),
+                         "%s{\"kind\":\"%s\",\"number\":%d,\"label\":\"%s\",\"proc\":\"%s\","
+                         "\"parent\":\"%s\",\"instructions\":%llu}",
+                         (k ? "," : ""), sourceNames[src.kind], src.number,
+                         (src.label == -1 ? "" : prog.labels[src.label].c_str()),
+                         prog.procs[src.proc].c_str(),
+                         (src.parent == -1 ? "" : prog.labels[prog.sources[src.parent].label].c_str()),
+                         entries[k].first);
+                out << line;
+            }
+        }
+        out << "]}\n";
+    } else {
+        double scale = (total == 0 ? 0.0 : 100.0 / total);
+        snprintf(line, sizeof(line), "%-32s %12s %14s %6s\n", "procedure", "calls", "instructions", "%");
+        out << line;
+        for (unsigned long p = 0; p < prog.procs.size(); ++p) {
+            snprintf(line, sizeof(line), "%-32s %12llu %14llu %6.2f\n", prog.procs[p].c_str(),
+                     procCalls[p], procCount[p], procCount[p] * scale);
+            out << line;
+        }
+        for (int list = 0; list < 2; ++list) {
+            vector<pair<unsigned long long, int> > &entries = (list == 0 ? loops : statements);
+            out << (list == 0 ? "loops, with everything inside them\n" : "statements, on their own\n");
+            for (unsigned long k = 0; k < entries.size() && k < (unsigned long)topCount; ++k) {
+                const Source &src = prog.sources[-entries[k].second];
+                Emitter what;
+                what << sourceNames[src.kind];
+                if (src.label == -1) {
+                    what << " #" << src.number;
+                } else {
+                    what << ' ' << prog.labels[src.label];
+                }
+                what << " in " << prog.procs[src.proc];
+                if (src.parent != -1) what << " (" << prog.labels[prog.sources[src.parent].label] << ')';
+                snprintf(line, sizeof(line), "  %-45s %14llu %6.2f\n", what.buf.c_str(),
+                         entries[k].first, entries[k].first * scale);
+                out << line;
+            }
+        }
+    }
+    out.writeTo(stderr);
+}
+
+// Synthetic parse trees for the benchmarks. Each shape stresses one part
+// of the compiler at size n, and is written as a preorder listing without
+// recursion so n can be large.
+
+void genId(Emitter &w, const string &name) {
+    w << "expr term\nterm factor\nfactor ID\nID " << name << '\n';
+}
+
+void genDcl(Emitter &w, const string &name) {
+    w << "dcl type ID\ntype INT\nINT int\nID " << name << '\n';
+}
+
+string numbered(const char *prefix, int n) {
+    Emitter name;
+    name << prefix << n;
+    return name.buf;
+}
+
+// name(arg, arg, ...) with count arguments, as a term.
+void genCall(Emitter &w, const string &name, int count, const string &arg) {
+    w << "term factor\nfactor ID LPAREN arglist RPAREN\nID " << name << "\nLPAREN (\n";
+    for (int i = 1; i < count; ++i) {
+        w << "arglist expr COMMA arglist\n";
+        genId(w, arg);
+        w << "COMMA ,\n";
+    }
+    w << "arglist expr\n";
+    genId(w, arg);
+    w << "RPAREN )\n";
+}
+
+// int wain(int a, int b) {, up to its dcls.
+void genMainHead(Emitter &w) {
+    w << "procedures main\n"
+      << "main INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE\n"
+      << "INT int\nWAIN wain\nLPAREN (\n";
+    genDcl(w, "a");
+    w << "COMMA ,\n";
+    genDcl(w, "b");
+    w << "RPAREN )\nLBRACE {\n";
+}
+
+void genReturn(Emitter &w, const string &name) {
+    w << "RETURN return\n";
+    genId(w, name);
+    w << "SEMI ;\nRBRACE }\n";
+}
+
+// a = a + 1 - 2 + 3 ...: a left-recursive expr n operators deep.
+void genChain(Emitter &w, int n) {
+    genMainHead(w);
+    w << "dcls\nstatements statements statement\nstatements\n"
+      << "statement lvalue BECOMES expr SEMI\nlvalue ID\nID a\nBECOMES =\n";
+    for (int i = n; i > 0; --i) w << (i % 2 ? "expr expr PLUS term\n" : "expr expr MINUS term\n");
+    genId(w, "a");
+    for (int i = 1; i <= n; ++i) {
+        w << (i % 2 ? "PLUS +\n" : "MINUS -\n") << "term factor\nfactor NUM\nNUM " << i << '\n';
+    }
+    w << "SEMI ;\n";
+    genReturn(w, "a");
+}
+
+// n procedures, each calling the one defined before it.
+void genProcs(Emitter &w, int n) {
+    for (int i = 0; i < n; ++i) {
+        w << "procedures procedure procedures\n"
+          << "procedure INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE\n"
+          << "INT int\nID " << numbered("p", i) << "\nLPAREN (\nparams paramlist\nparamlist dcl\n";
+        genDcl(w, "x");
+        w << "RPAREN )\nLBRACE {\ndcls\nstatements\nRETURN return\n";
+        if (i == 0) {
+            genId(w, "x");
+        } else {
+            w << "expr expr PLUS term\n";
+            genId(w, "x");
+            w << "PLUS +\n";
+            genCall(w, numbered("p", i - 1), 1, "x");
+        }
+        w << "SEMI ;\nRBRACE }\n";
+    }
+    genMainHead(w);
+    w << "dcls\nstatements\nRETURN return\nexpr term\n";
+    genCall(w, numbered("p", n - 1), 1, "a");
+    w << "SEMI ;\nRBRACE }\n";
+}
+
+// int v0 = 0; ... : n declarations in wain.
+void genDcls(Emitter &w, int n) {
+    genMainHead(w);
+    for (int i = 0; i < n; ++i) w << "dcls dcls dcl BECOMES NUM SEMI\n";
+    w << "dcls\n";
+    for (int i = 0; i < n; ++i) {
+        genDcl(w, numbered("v", i));
+        w << "BECOMES =\nNUM " << i << "\nSEMI ;\n";
+    }
+    w << "statements\n";
+    genReturn(w, "a");
+}
+
+// while / if alternately nested n deep around a = a + 1.
+void genNest(Emitter &w, int n) {
+    genMainHead(w);
+    w << "dcls\n";
+    for (int i = 0; i < n; ++i) {
+        w << "statements statements statement\nstatements\n";
+        if (i % 2 == 0) {
+            w << "statement WHILE LPAREN test RPAREN LBRACE statements RBRACE\n"
+              << "WHILE while\nLPAREN (\ntest expr LT expr\n";
+            genId(w, "a");
+            w << "LT <\n";
+        } else {
+            w << "statement IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE\n"
+              << "IF if\nLPAREN (\ntest expr NE expr\n";
+            genId(w, "a");
+            w << "NE !=\n";
+        }
+        genId(w, "b");
+        w << "RPAREN )\nLBRACE {\n";
+    }
+    w << "statements statements statement\nstatements\n"
+      << "statement lvalue BECOMES expr SEMI\nlvalue ID\nID a\nBECOMES =\nexpr expr PLUS term\n";
+    genId(w, "a");
+    w << "PLUS +\nterm factor\nfactor NUM\nNUM 1\nSEMI ;\n";
+    for (int i = n - 1; i >= 0; --i) {
+        w << (i % 2 == 0 ? "RBRACE }\n" : "RBRACE }\nELSE else\nLBRACE {\nstatements\nRBRACE }\n");
+    }
+    genReturn(w, "a");
+}
+
+// One procedure taking n parameters, called once.
+void genArgs(Emitter &w, int n) {
+    w << "procedures procedure procedures\n"
+      << "procedure INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE\n"
+      << "INT int\nID f\nLPAREN (\nparams paramlist\n";
+    for (int i = 0; i < n; ++i) {
+        w << (i + 1 < n ? "paramlist dcl COMMA paramlist\n" : "paramlist dcl\n");
+        genDcl(w, numbered("x", i));
+        if (i + 1 < n) w << "COMMA ,\n";
+    }
+    w << "RPAREN )\nLBRACE {\ndcls\nstatements\n";
+    genReturn(w, numbered("x", n - 1));
+    genMainHead(w);
+    w << "dcls\nstatements\nRETURN return\nexpr term\n";
+    genCall(w, "f", n, "a");
+    w << "SEMI ;\nRBRACE }\n";
+}
+
+struct Shape {
+    const char *name;
+    void (*gen)(Emitter &w, int n);
+};
+
+const Shape shapes[] = {
+    { "chain", genChain },
+    { "procs", genProcs },
+    { "dcls", genDcls },
+    { "nest", genNest },
+    { "args", genArgs },
+};
+const int numShapes = sizeof(shapes) / sizeof(shapes[0]);
+
+// The listing for shape at size n, or false if there is no such shape.
+bool genShape(const string &shape, int n, Emitter &w) {
+    for (int i = 0; i < numShapes; ++i) {
+        if (shape != shapes[i].name) continue;
+        w << "start BOF procedures EOF\nBOF BOF\n";
+        shapes[i].gen(w, n);
+        w << "EOF EOF\n";
+        return true;
+    }
+    return false;
+}
+
+// Largest resident set so far, in kilobytes.
+long peakRss() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss;
+}
+
+// --bench SHAPE N: compile the shape (every shape for "all") at size n and
+// print one JSON line per shape with the seconds spent in each phase. The
+// peak RSS is for the whole process, so run shapes one at a time to
+// compare their memory.
+int runBench(const string &shape, int n, unsigned int threads) {
+    Emitter report;
+    for (int i = 0; i < numShapes; ++i) {
+        if (shape != "all" && shape != shapes[i].name) continue;
+        Emitter listing;
+        genShape(shapes[i].name, n, listing);
+        stringstream in(listing.buf);
+        listing.buf.clear();
+        
+        Program prog;
+        string err;
+        CompileStats stats;
+        if (!compile(in, prog, threads, err, &stats)) {
+            cerr << shapes[i].name << ": " << err << endl;
+            return 1;
+        }
+        Clock::time_point start = Clock::now();
+        Emitter out;
+        printProgram(prog, out);
+        double print = secondsSince(start);
+        double total = stats.parse + stats.check + stats.generate + print;
+        
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "{\"shape\":\"%s\",\"n\":%d,\"nodes\":%lu,\"instrs\":%lu,"
+                 "\"parse\":%.6f,\"check\":%.6f,\"generate\":%.6f,\"print\":%.6f,"
+                 "\"total\":%.6f,\"nodes_per_sec\":%.0f,\"peak_rss_kb\":%ld}\n",
+                 shapes[i].name, n, stats.nodes, (unsigned long)prog.code.size(),
+                 stats.parse, stats.check, stats.generate, print,
+                 total, (total > 0 ? stats.nodes / total : 0.0), peakRss());
+        report << line;
+    }
+    if (report.buf.empty()) {
+        cerr << "ERROR: unknown shape " << shape << endl;
+        return 1;
+    }
+    report.writeTo(stdout);
+    return 0;
+}
+
+int main(int argc, const char * argv[]) {
+    string outFile;                 // -o FILE; stdout when empty
+    string batchList;               // --batch LIST
+    string genShapeName, benchShape;        // --gen / --bench SHAPE N
+    bool timePasses = false, showStats = false, statsJson = false;
+    bool run = false;                       // --run A B / --run-array LIST
+    bool profile = false;
+    int runA = 0, runB = 0;
+    vector<int> runArray;
+    int shapeSize = 0;
+    unsigned int threads = std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) {
+            outFile = argv[++i];
+        } else if (arg == "-j" && i + 1 < argc) {
+            threads = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batchList = argv[++i];
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cacheDir = argv[++i];
+            mkdir(cacheDir.c_str(), 0777);  // may already exist
+        } else if (arg == "--run" && i + 2 < argc) {
+            run = true;
+            runA = (int)strtol(argv[i + 1], NULL, 10);
+            runB = (int)strtol(argv[i + 2], NULL, 10);
+            i += 2;
+        } else if (arg == "--run-array" && i + 1 < argc) {
+            run = true;
+            stringstream values(argv[++i]);
+            string value;
+            while (getline(values, value, ',')) runArray.push_back((int)strtol(value.c_str(), NULL, 10));
+        } else if (arg == "--link" && i + 1 < argc) {
+            stringstream paths(argv[++i]);
+            string path;
+            while (getline(paths, path, ',')) {
+                runtimeObjects.push_back(MerlModule());
+                try {
+                    readMerl(path, runtimeObjects.back());
+                } catch (string e) {
+                    cerr << e << endl;
+                    return 1;
+                }
+            }
+        } else if (arg == "--merl") {
+            merlOutput = true;
+        } else if (arg == "--profile") {
+            profile = true;
+        } else if (arg == "--time-passes") {
+            timePasses = true;
+        } else if (arg == "--stats") {
+            showStats = true;
+        } else if (arg == "--stats-json") {
+            showStats = statsJson = true;
+        } else if ((arg == "--gen" || arg == "--bench") && i + 2 < argc && atoi(argv[i + 2]) > 0) {
+            (arg == "--gen" ? genShapeName : benchShape) = argv[++i];
+            shapeSize = atoi(argv[++i]);
+        } else {
+            cerr << "usage: " << argv[0] << " [-o file.asm] [--merl | --link a.merl,...] [-j threads] [--cache dir]\n"
+                 << "           [--time-passes] [--stats] [--stats-json]\n"
+                 << "           [--run a b | --run-array v,v,...] [--profile] < file.wlp4i\n"
+                 << "       " << argv[0] << " --batch list [--merl | --link a.merl,...] [-j threads] [--cache dir]\n"
+                 << "       " << argv[0] << " --gen shape n [-o file.wlp4i]\n"
+                 << "       " << argv[0] << " --bench shape|all n [-j threads]\n"
+                 << "shapes: chain procs dcls nest args" << endl;
+            return 1;
+        }
+    }
+    if (threads == 0) threads = 1;
+    if (profile && !run) {
+        cerr << "ERROR: --profile needs --run or --run-array" << endl;
+        return 1;
+    }
+    if (!batchList.empty()) return runBatch(batchList, threads);
+    if (!benchShape.empty()) return runBench(benchShape, shapeSize, threads);
+    if (!genShapeName.empty()) {
+        Emitter listing;
+        if (!genShape(genShapeName, shapeSize, listing)) {
+            cerr << "ERROR: unknown shape " << genShapeName << endl;
+            return 1;
+        }
+        FILE *f = (outFile.empty() ? stdout : fopen(outFile.c_str(), "w"));
+        bool ok = (f != NULL && listing.writeTo(f));
+        if (f != NULL && f != stdout) ok = (fclose(f) == 0) && ok;
+        if (!ok) {
+            cerr << "ERROR: cannot write " << (outFile.empty() ? "output" : outFile) << endl;
+            return 1;
+        }
+        return 0;
+    }
+    
+    Program prog;
+    string err;
+    CompileStats stats;
+    if (!compile(std::cin, prog, threads, err, &stats)) {
+        // nothing is written for a rejected program, as with --batch
+        cerr << err << endl;
+        return 1;
+    }
+    
+    if (run) {
+        // the assembly is only written with -o; stdout gets what it prints
+        if (!outFile.empty() && !writeProgram(prog, outFile, err)) {
+            cerr << err << endl;
+            return 1;
+        }
+        if (timePasses || showStats) reportStats(stats, prog, showStats, statsJson);
+        Emitter printed;
+        RunStats runStats;
+        bool ok = true;
+        try {
+            runProgram(prog, runA, runB, (runArray.empty() ? NULL : &runArray), printed, runStats);
+        } catch (string e) {
+            cerr << e << endl;
+            ok = false;
+        }
+        printed.writeTo(stdout);
+        if (ok) reportRun(runStats, statsJson);
+        if (ok && profile) reportProfile(prog, runStats, statsJson);
+        return (ok ? 0 : 1);
+    }
+    
+    Clock::time_point start = Clock::now();
+    string writeErr;
+    if (!writeProgram(prog, outFile, writeErr)) {
+        cerr << writeErr << endl;
+        return 1;
+    }
+    stats.print = secondsSince(start);
+    if (timePasses || showStats) reportStats(stats, prog, showStats, statsJson);
+    return 0;
+}